@@ -0,0 +1,540 @@
+/*
+ * Compare the epoll and io_uring backends on real evdev and uinput
+ * devices. A synthetic touchscreen is made with uinput, trackscreen is
+ * started on it with each backend in turn, and the same stroke is played
+ * through it. The syscall and frame counts come from --metrics, and the
+ * trackpad trackscreen makes is read back to check no frame arrived out
+ * of order.
+ *
+ * Needs root (or access to /dev/uinput and /dev/input). Build with
+ * make tests, then run from the top of the tree:
+ *
+ *     tests/bin/uring_bench [frames [interval_usec [binary]]]
+ */
+#include <linux/input.h>
+#include <linux/io_uring.h>
+#include <linux/uinput.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_FRAMES 1000
+#define DEFAULT_INTERVAL 1000
+#define DEFAULT_BINARY "bin/trackscreen"
+#define METRICS_PATH "/tmp/trackscreen-uring-bench.sock"
+#define TRACKPAD_NAME "Trackscreen"
+#define LATENCY_METRIC "trackscreen_frame_latency_seconds"
+#define PANEL_MAX 4095
+/* Inside the default trackpad region, the bottom center third. */
+#define STROKE_X 1400
+#define STROKE_Y 3400
+#define STROKE_FRAMES 1200
+#define SETTLE_MS 200
+#define STARTUP_TRIES 100
+
+typedef struct bench_result {
+        double frames; /* trackscreen_frames_total */
+        double syscalls; /* trackscreen_syscalls_total */
+        double latency_sum; /* Seconds, from the latency histogram */
+        double latency_count;
+        unsigned long out_of_order; /* Trackpad X going backwards */
+        unsigned long events; /* Trackpad events read back */
+        unsigned long dropped; /* SYN_DROPPED from reading back too late */
+        int last_x; /* Trackpad X last read back, or -1 between touches */
+} bench_result;
+
+static void sleep_ms(long ms) {
+        struct timespec delay;
+
+        delay.tv_sec = ms / 1000;
+        delay.tv_nsec = (ms % 1000) * 1000000;
+        nanosleep(&delay, NULL);
+        return;
+}
+
+static int emit(int fd, uint16_t type, uint16_t code, int32_t value) {
+        struct input_event ev;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.type = type;
+        ev.code = code;
+        ev.value = value;
+        if (write(fd, &ev, sizeof(ev)) != sizeof(ev)) {
+                return -1;
+        }
+
+        return 0;
+}
+
+static int set_axis(int fd, uint16_t code, int maximum) {
+        struct uinput_abs_setup abs;
+
+        memset(&abs, 0, sizeof(abs));
+        abs.code = code;
+        abs.absinfo.maximum = maximum;
+        abs.absinfo.resolution = 14;
+        return ioctl(fd, UI_ABS_SETUP, &abs);
+}
+
+/* A ten finger touchscreen, 4096 units (about 290 mm) square. */
+static int create_touchscreen(char *node, size_t size) {
+        char path[PATH_MAX];
+        char sysname[64];
+        struct dirent *entry;
+        DIR *directory;
+        int fd;
+        struct uinput_setup setup;
+
+        fd = open("/dev/uinput", O_WRONLY | O_CLOEXEC);
+        if (fd < 0) {
+                perror("Cannot open /dev/uinput");
+                return -1;
+        }
+
+        memset(&setup, 0, sizeof(setup));
+        setup.id.bustype = BUS_VIRTUAL;
+        setup.id.vendor = 0x1d6b;
+        setup.id.product = 0x0104;
+        strcpy(setup.name, "Trackscreen Bench Touchscreen");
+        if ((ioctl(fd, UI_SET_EVBIT, EV_KEY) != 0) ||
+            (ioctl(fd, UI_SET_KEYBIT, BTN_TOUCH) != 0) ||
+            (ioctl(fd, UI_SET_EVBIT, EV_ABS) != 0) ||
+            (ioctl(fd, UI_SET_PROPBIT, INPUT_PROP_DIRECT) != 0) ||
+            (ioctl(fd, UI_SET_ABSBIT, ABS_X) != 0) ||
+            (ioctl(fd, UI_SET_ABSBIT, ABS_Y) != 0) ||
+            (ioctl(fd, UI_SET_ABSBIT, ABS_MT_SLOT) != 0) ||
+            (ioctl(fd, UI_SET_ABSBIT, ABS_MT_POSITION_X) != 0) ||
+            (ioctl(fd, UI_SET_ABSBIT, ABS_MT_POSITION_Y) != 0) ||
+            (ioctl(fd, UI_SET_ABSBIT, ABS_MT_TRACKING_ID) != 0) ||
+            (set_axis(fd, ABS_X, PANEL_MAX) != 0) ||
+            (set_axis(fd, ABS_Y, PANEL_MAX) != 0) ||
+            (set_axis(fd, ABS_MT_SLOT, 9) != 0) ||
+            (set_axis(fd, ABS_MT_POSITION_X, PANEL_MAX) != 0) ||
+            (set_axis(fd, ABS_MT_POSITION_Y, PANEL_MAX) != 0) ||
+            (set_axis(fd, ABS_MT_TRACKING_ID, 65535) != 0) ||
+            (ioctl(fd, UI_DEV_SETUP, &setup) != 0) ||
+            (ioctl(fd, UI_DEV_CREATE) != 0) ||
+            (ioctl(fd, UI_GET_SYSNAME(sizeof(sysname)), sysname) < 0)) {
+
+                perror("Cannot create the touchscreen");
+                close(fd);
+                return -1;
+        }
+
+        snprintf(path, sizeof(path), "/sys/devices/virtual/input/%s", sysname);
+        directory = opendir(path);
+        if (directory == NULL) {
+                perror("Cannot find the touchscreen in sysfs");
+                goto createTouchscreenFail;
+        }
+
+        node[0] = '\0';
+        while ((entry = readdir(directory)) != NULL) {
+                if (strncmp(entry->d_name, "event", 5) == 0) {
+                        snprintf(node, size, "/dev/input/%s", entry->d_name);
+                        break;
+                }
+        }
+
+        closedir(directory);
+        if (node[0] == '\0') {
+                fprintf(stderr, "The touchscreen has no event node\n");
+                goto createTouchscreenFail;
+        }
+
+        /* Give udev time to make the node and set its permissions. */
+        sleep_ms(SETTLE_MS);
+        return fd;
+
+createTouchscreenFail:
+        ioctl(fd, UI_DEV_DESTROY);
+        close(fd);
+        return -1;
+}
+
+/* Open the trackpad a trackscreen process made, once it is there. */
+static int open_trackpad(void) {
+        char name[256];
+        char path[PATH_MAX];
+        struct dirent *entry;
+        DIR *directory;
+        int fd;
+        int tries;
+
+        for (tries = 0; tries < STARTUP_TRIES; tries += 1) {
+                directory = opendir("/dev/input");
+                if (directory == NULL) {
+                        return -1;
+                }
+
+                while ((entry = readdir(directory)) != NULL) {
+                        if (strncmp(entry->d_name, "event", 5) != 0) {
+                                continue;
+                        }
+
+                        snprintf(path,
+                                 sizeof(path),
+                                 "/dev/input/%s",
+                                 entry->d_name);
+
+                        fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+                        if (fd < 0) {
+                                continue;
+                        }
+
+                        memset(name, 0, sizeof(name));
+                        if ((ioctl(fd,
+                                   EVIOCGNAME(sizeof(name) - 1),
+                                   name) >= 0) &&
+                            (strcmp(name, TRACKPAD_NAME) == 0)) {
+
+                                closedir(directory);
+                                return fd;
+                        }
+
+                        close(fd);
+                }
+
+                closedir(directory);
+                sleep_ms(20);
+        }
+
+        fprintf(stderr, "trackscreen never made its trackpad\n");
+        return -1;
+}
+
+/*
+ * Within a touch, the trackpad X must never go back. This reads whatever
+ * has arrived so far, so it is called as the stroke is played, before
+ * the trackpad's evdev buffer can fill up.
+ */
+static void check_order(int fd, bench_result *result) {
+        struct input_event ev[64];
+        int index;
+        ssize_t size;
+
+        while (true) {
+                size = read(fd, ev, sizeof(ev));
+                if (size <= 0) {
+                        break;
+                }
+
+                for (index = 0; index < size / sizeof(ev[0]); index += 1) {
+                        result->events += 1;
+                        if ((ev[index].type == EV_SYN) &&
+                            (ev[index].code == SYN_DROPPED)) {
+
+                                result->dropped += 1;
+                                result->last_x = -1;
+
+                        } else if (ev[index].type != EV_ABS) {
+                                continue;
+
+                        } else if (ev[index].code == ABS_MT_TRACKING_ID) {
+                                result->last_x = -1;
+
+                        } else if (ev[index].code == ABS_MT_POSITION_X) {
+                                if (ev[index].value < result->last_x) {
+                                        result->out_of_order += 1;
+                                }
+
+                                result->last_x = ev[index].value;
+                        }
+                }
+        }
+
+        return;
+}
+
+/*
+ * Play one finger moving right one unit a frame, lifting and touching
+ * again whenever it would leave the trackpad region.
+ */
+static int play_stroke(int fd,
+                       int trackpad,
+                       int frames,
+                       long interval,
+                       bench_result *result) {
+
+        int frame;
+        int step;
+        int x;
+        struct timespec delay;
+
+        delay.tv_sec = interval / 1000000;
+        delay.tv_nsec = (interval % 1000000) * 1000;
+        for (frame = 0; frame < frames; frame += 1) {
+                step = frame % STROKE_FRAMES;
+                if (emit(fd, EV_ABS, ABS_MT_SLOT, 0) != 0) {
+                        return -1;
+                }
+
+                if (step == 0) {
+                        if ((emit(fd,
+                                  EV_ABS,
+                                  ABS_MT_TRACKING_ID,
+                                  frame / STROKE_FRAMES) != 0) ||
+                            (emit(fd, EV_KEY, BTN_TOUCH, 1) != 0) ||
+                            (emit(fd,
+                                  EV_ABS,
+                                  ABS_MT_POSITION_Y,
+                                  STROKE_Y) != 0) ||
+                            (emit(fd, EV_ABS, ABS_Y, STROKE_Y) != 0)) {
+
+                                return -1;
+                        }
+                }
+
+                x = STROKE_X + step;
+                if ((emit(fd, EV_ABS, ABS_MT_POSITION_X, x) != 0) ||
+                    (emit(fd, EV_ABS, ABS_X, x) != 0)) {
+
+                        return -1;
+                }
+
+                if ((step == STROKE_FRAMES - 1) || (frame == frames - 1)) {
+                        if ((emit(fd, EV_ABS, ABS_MT_TRACKING_ID, -1) != 0) ||
+                            (emit(fd, EV_KEY, BTN_TOUCH, 0) != 0)) {
+
+                                return -1;
+                        }
+                }
+
+                if (emit(fd, EV_SYN, SYN_REPORT, 0) != 0) {
+                        return -1;
+                }
+
+                if (interval != 0) {
+                        nanosleep(&delay, NULL);
+                }
+
+                check_order(trackpad, result);
+        }
+
+        return 0;
+}
+
+static double metric(const char *text, const char *name) {
+        char pattern[128];
+        const char *line;
+
+        snprintf(pattern, sizeof(pattern), "\n%s ", name);
+        line = strstr(text, pattern);
+        if (line == NULL) {
+                return 0;
+        }
+
+        return strtod(line + strlen(pattern), NULL);
+}
+
+static int read_metrics(bench_result *result) {
+        struct sockaddr_un address;
+        char buffer[16384];
+        int fd;
+        ssize_t size;
+        size_t used;
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+                return -1;
+        }
+
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        strcpy(address.sun_path, METRICS_PATH);
+        if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+                perror("Cannot read metrics");
+                close(fd);
+                return -1;
+        }
+
+        /* Lead with a newline so every name can be matched at a line start. */
+        buffer[0] = '\n';
+        used = 1;
+        while (used < sizeof(buffer) - 1) {
+                size = read(fd, buffer + used, sizeof(buffer) - 1 - used);
+                if (size <= 0) {
+                        break;
+                }
+
+                used += size;
+        }
+
+        buffer[used] = '\0';
+        close(fd);
+        result->frames = metric(buffer, "trackscreen_frames_total");
+        result->syscalls = metric(buffer, "trackscreen_syscalls_total");
+        result->latency_sum = metric(buffer, LATENCY_METRIC "_sum");
+        result->latency_count = metric(buffer, LATENCY_METRIC "_count");
+
+        return 0;
+}
+
+static int run_backend(const char *binary,
+                       const char *node,
+                       int touchscreen,
+                       int use_uring,
+                       int frames,
+                       long interval,
+                       bench_result *result) {
+
+        char *argv[6];
+        int argc;
+        pid_t child;
+        int status;
+        int trackpad;
+
+        memset(result, 0, sizeof(*result));
+        result->last_x = -1;
+        argc = 0;
+        argv[argc++] = (char *)binary;
+        argv[argc++] = "--metrics=" METRICS_PATH;
+        if (use_uring != 0) {
+                argv[argc++] = "-u";
+        }
+
+        argv[argc++] = (char *)node;
+        argv[argc] = NULL;
+        child = fork();
+        if (child < 0) {
+                perror("Cannot fork");
+                return -1;
+        }
+
+        if (child == 0) {
+                execv(binary, argv);
+                perror(binary);
+                _exit(127);
+        }
+
+        status = -1;
+        trackpad = open_trackpad();
+        if (trackpad < 0) {
+                goto runBackendEnd;
+        }
+
+        if (play_stroke(touchscreen, trackpad, frames, interval, result) != 0) {
+                perror("Cannot write to the touchscreen");
+                goto runBackendEnd;
+        }
+
+        sleep_ms(SETTLE_MS);
+        check_order(trackpad, result);
+        status = read_metrics(result);
+
+runBackendEnd:
+        if (trackpad >= 0) {
+                close(trackpad);
+        }
+
+        kill(child, SIGTERM);
+        waitpid(child, NULL, 0);
+        return status;
+}
+
+static void print_result(const char *backend, const bench_result *result) {
+        printf("%-8s %6.0f frames, %6.0f syscalls, %.2f per frame, ",
+               backend,
+               result->frames,
+               result->syscalls,
+               (result->frames != 0) ? result->syscalls / result->frames : 0);
+
+        printf("%.1f us mean latency\n",
+               (result->latency_count != 0) ?
+               result->latency_sum * 1e6 / result->latency_count : 0);
+
+        printf("%-8s %lu trackpad events read back, %lu out of order, "
+               "%lu SYN_DROPPED\n",
+               "",
+               result->events,
+               result->out_of_order,
+               result->dropped);
+
+        return;
+}
+
+int main(int argc, char **argv) {
+        const char *binary;
+        int frames;
+        long interval;
+        char node[PATH_MAX];
+        struct io_uring_params params;
+        bench_result result;
+        int ring;
+        int status;
+        int touchscreen;
+
+        frames = (argc > 1) ? atoi(argv[1]) : DEFAULT_FRAMES;
+        interval = (argc > 2) ? atol(argv[2]) : DEFAULT_INTERVAL;
+        binary = (argc > 3) ? argv[3] : DEFAULT_BINARY;
+        if ((frames <= 0) || (interval < 0)) {
+                fprintf(stderr,
+                        "Usage: %s [frames [interval_usec [binary]]]\n",
+                        argv[0]);
+
+                return 2;
+        }
+
+        touchscreen = create_touchscreen(node, sizeof(node));
+        if (touchscreen < 0) {
+                return 1;
+        }
+
+        printf("%d frames, one every %ld us, through %s\n",
+               frames,
+               interval,
+               node);
+
+        status = 1;
+        if (run_backend(binary, node, touchscreen, 0, frames, interval,
+                        &result) != 0) {
+
+                goto mainEnd;
+        }
+
+        print_result("epoll", &result);
+        if (result.out_of_order != 0) {
+                goto mainEnd;
+        }
+
+        /* trackscreen would quietly fall back, so say so here instead. */
+        memset(&params, 0, sizeof(params));
+        ring = syscall(__NR_io_uring_setup, 4, &params);
+        if (ring < 0) {
+                printf("io_uring  unavailable: %s\n", strerror(errno));
+                status = 0;
+                goto mainEnd;
+        }
+
+        close(ring);
+        if (run_backend(binary, node, touchscreen, 1, frames, interval,
+                        &result) != 0) {
+
+                goto mainEnd;
+        }
+
+        print_result("io_uring", &result);
+        if (result.out_of_order == 0) {
+                status = 0;
+        }
+
+mainEnd:
+        ioctl(touchscreen, UI_DEV_DESTROY);
+        close(touchscreen);
+        return status;
+}
@@ -1,23 +1,130 @@
+#define _GNU_SOURCE
+
 #include <linux/uinput.h>
 #include <linux/types.h>
 #include <linux/input.h>
 #include <linux/hidraw.h>
+#include <linux/io_uring.h>
+#include <linux/perf_event.h>
 
-#include <dirent.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/personality.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/utsname.h>
 #include <time.h>
 #include <unistd.h>
 
-#define MAX_FINGERS 10
-#define MAX_EVENTS_PER_REPORT 24
+#include <libudev.h>
+
+/*
+ * USDT probes, so bpftrace and friends can time each pipeline stage on a
+ * live unit. With <sys/sdt.h> available each probe is a nop until traced;
+ * without it they compile away entirely.
+ *
+ * bpftrace -e 'usdt:/usr/local/bin/trackscreen:trackscreen:frame_write
+ *     { @[arg0] = count(); }'
+ */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define HAVE_SDT 1
+#endif
+#endif
+
+#ifdef HAVE_SDT
+#define TRACE_SEMAPHORE(name) \
+        __extension__ unsigned short trackscreen_##name##_semaphore \
+        __attribute__((unused)) __attribute__((section(".probes")))
+
+#define TRACE(name, ...) STAP_PROBEV(trackscreen, name, ##__VA_ARGS__)
+#define TRACE_ENABLED(name) \
+        __builtin_expect(*(volatile unsigned short *) \
+                         &trackscreen_##name##_semaphore, 0)
+
+#else
+#define TRACE_SEMAPHORE(name) extern int trackscreen_trace_unused
+#define TRACE(name, ...)
+#define TRACE_ENABLED(name) 0
+#endif
+
+TRACE_SEMAPHORE(event_read);
+TRACE_SEMAPHORE(frame_commit);
+TRACE_SEMAPHORE(frame_slot);
+TRACE_SEMAPHORE(bounds_entry);
+TRACE_SEMAPHORE(bounds_exit);
+TRACE_SEMAPHORE(frame_write);
+TRACE_SEMAPHORE(sidekey);
+
+#define MAX_SLOTS 1024
+#define RESYNC_AXES 4
+#define MATCHER_AXES 8
+#define WAIT_EVENTS (IN_CREATE | IN_MOVED_TO | IN_ATTRIB)
+#define WAIT_RETRY_MS 100 /* Retry period for a node that isn't ready */
+#define CONFIG_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO)
+#define CACHE_MAGIC 0x31435354 /* "TSC1" */
+#define UPGRADE_MAGIC 0x32505554 /* "TUP2" */
+#define UPGRADE_VERSION 1 /* Bumped whenever upgrade_state changes */
+#define REPORT_DEVICE_EVENTS 24 /* Keys and single touch axes per report */
+#define REPORT_SLOT_EVENTS (MT_AXES + 1) /* A slot switch and its axes */
+#define MAX_EVENTS_PER_READ 64
+#define MT_AXES (ABS_MT_TOOL_Y - ABS_MT_SLOT)
+#define MT_AXIS(code) ((code) - ABS_MT_SLOT - 1)
+#define MAX_LOOP_EVENTS 8
+#define OUTPUT_FRAME_EVENTS 64
+#define OUTPUT_QUEUE_FRAMES 32
+#define EMITTED_UNKNOWN INT32_MIN /* Matches no value, so it gets sent */
+#define OUTPUT_CHAIN_FRAMES 16
+#define OUTPUT_RETRY_NSEC 1000000
+#define URING_ENTRIES 64
+#define URING_FALLBACK 2
+#define DEFAULT_RT_PRIORITY 50
+#define FALLBACK_PANEL_WIDTH_MM 294
+#define MAX_REGION_MM 2000
+#define FLIP_X 0x1
+#define FLIP_Y 0x2
+#define PREFAULT_STACK_SIZE (256 * 1024)
+#define LOG_RING_SIZE 4096
+#define LOG_DRAIN_BATCH 256
+#define FLIGHT_RECORDER_EVENTS 32768
+#define FLIGHT_RECORDER_KEY_EVENTS 1024
+#define FLIGHT_RECORDER_SECONDS 10
+#define DEFAULT_FLIGHT_DIR "/tmp"
+#define LATENCY_BUCKETS 10
+#define METRICS_BUFFER_SIZE 8192
+#define TRACE_FRAMES 16384
+#define PERF_COUNTERS 6
+#define DEFAULT_ANALYZE_SECONDS 10
+#define ANALYZE_BUCKETS 128
+#define ANALYZE_BUCKET_USEC 250
+#define ANALYZE_GAP_USEC 100000
 
 #define USAGE \
         "Usage: %s /path/to/touchscreen\n\n" \
@@ -26,18 +133,75 @@
         "the touchscreen, something like /dev/input/XX. Use evtest to\n" \
         "figure out the value of XX that corresponds to your touchscreen.\n" \
         "Options:\n" \
+        "  -c file -- Read settings from an INI file, see trackscreen.ini.\n" \
+        "     The command line overrides the file, and the touchscreen\n" \
+        "     argument can be left out if the file names one. The\n" \
+        "     trackpad region, orientation, scale, keys and frame interval\n" \
+        "     are reloaded on SIGHUP or when the file changes, except that\n" \
+        "     turning by 90 or 270 degrees needs a restart.\n" \
         "  -d left,top,width,height -- Define the percentages along the \n" \
         "     touchpad screen where the virtual trackpad should be \n" \
         "     active. If not specified, the default is -d 33,67,33,33 \n" \
-        "     for the center bottom tic-tac-toe square.\n" \
+        "     for the center bottom tic-tac-toe square. Any of the four\n" \
+        "     can be millimetres instead, as in -d 40mm,67,80mm,33.\n" \
         "  -k leftkeycode[,rightkeycode] -- Create a fake keyboard and \n" \
         "     send keyboard events whenever there are touches to the side \n" \
         "     of the trackpad. See input-event-codes.h for KEY_* \n" \
         "     definitions.\n" \
-        "  -n -- Connect to the device by name instead of path Try evtest \n" \
-        "     to get a list of names\n." \
+        "  -s scale -- Multiply trackpad motion by scale (default 1).\n" \
+        "     Once running, it can be lowered but not raised past that.\n" \
+        "  -n -- Connect to the device by name instead of path. Try evtest \n" \
+        "     to get a list of names. Instead of an exact name, the \n" \
+        "     argument can be comma separated terms that must all match:\n" \
+        "     name=glob, id=vendor:product (hex), phys=glob, uniq=glob\n" \
+        "     and abs=axis[+axis...], where an axis is x, y, pressure,\n" \
+        "     mt_slot, mt_position_x, mt_position_y, mt_tracking_id,\n" \
+        "     mt_pressure or an ABS_* number. For example\n" \
+        "     -n 'id=04f3:2a1c,phys=usb-0000:00:14.0-4*'\n" \
+        "  -u -- Use io_uring for touchscreen reads and uinput writes,\n" \
+        "     falling back to epoll and read/write if it is unavailable.\n" \
         "  -h -- Show this help.\n" \
-        "  -v -- Verbose\n"
+        "  -v -- Verbose\n" \
+        "  --realtime[=priority] -- Run SCHED_FIFO at the given priority \n" \
+        "     (default 50), with all memory locked and prefaulted.\n" \
+        "  --cpus=list -- Pin to the given CPUs, for example 3 or 0,2-3.\n" \
+        "  --flight-recorder=dir -- Where to save the recent event history \n" \
+        "     on SIGUSR2, SYN_DROPPED or an abnormal exit (default /tmp).\n" \
+        "     The files are evemu recordings of the touchscreen.\n" \
+        "  --rotate=degrees -- The screen is turned clockwise by 90, 180 or\n" \
+        "     270 degrees, as with xrandr --rotate right, inverted or left.\n" \
+        "     Touches are turned to match, and -d is as seen after turning.\n" \
+        "  --flip=x|y|xy -- Mirror touches left to right, top to bottom or\n" \
+        "     both, after any --rotate.\n" \
+        "  --profiles=dir -- Look in dir for a profile for the attached\n" \
+        "     touchscreen, named vvvv:pppp.ini after its vendor and product\n" \
+        "     IDs (hex) or else after its name, as in 'ELAN Touch.ini'. It\n" \
+        "     can set [trackpad], [keys] and [filters] like a -c file,\n" \
+        "     overriding that file but not the command line.\n" \
+        "  --metrics=path -- Serve counters in Prometheus text format on a\n" \
+        "     Unix socket at path.\n" \
+        "  --trace=file -- Record per-frame stage timing and write it to\n" \
+        "     file as a Chrome trace on exit or SIGUSR2.\n" \
+        "  --perf -- Count cycles, instructions, cache misses and more with\n" \
+        "     perf_event_open while frames are processed, and report them\n" \
+        "     per frame on exit and in --metrics.\n" \
+        "  --analyze[=seconds] -- Report the panel's actual report rate,\n" \
+        "     interval jitter, per-slot update rate and SYN_DROPPED rate\n" \
+        "     every period (default 10 seconds) and on exit.\n" \
+        "  --frame-interval=usec -- Send the trackpad at most one motion\n" \
+        "     frame per interval, for example 16667 for a 60 Hz display.\n" \
+        "     Touches, lifts and buttons are still sent immediately.\n" \
+        "  --cache=file -- With -n, remember the touchscreen's node,\n" \
+        "     identity and axes in file, and skip searching for it on the\n" \
+        "     next start if the same device is still there.\n" \
+        "  --control=path -- Accept runtime changes to the trackpad\n" \
+        "     region, scale, frame interval and side keys on a Unix\n" \
+        "     SOCK_SEQPACKET socket at path.\n" \
+        "  --wait[=seconds] -- If the touchscreen is not there yet, wait\n" \
+        "     for it to appear, forever or up to the given time.\n" \
+        "SIGUSR1 re-executes the binary in place, for example after an\n" \
+        "upgrade. The touchscreen, the virtual devices and the touch state\n" \
+        "are handed over, so the compositor sees no change.\n"
 
 typedef struct position {
         int x;
@@ -49,36 +213,459 @@ typedef struct finger {
         int tracking_id;
 } finger;
 
-typedef struct trackscreen_context {
-        int ts; /* Touchscreen file descriptor */
+typedef struct trackscreen_context trackscreen_context;
+typedef struct loop_source loop_source;
+
+typedef int (*loop_callback)(trackscreen_context *ctx,
+                             loop_source *source,
+                             uint32_t events);
+
+struct loop_source {
+        int fd; /* Descriptor watched by the event loop */
+        loop_callback callback; /* Called when the descriptor is ready */
+};
+
+/* Per-slot axes replayed from the touchscreen after it reattaches. */
+static const uint16_t resync_axes[RESYNC_AXES] = {
+        ABS_MT_TRACKING_ID, ABS_MT_POSITION_X, ABS_MT_POSITION_Y,
+        ABS_MT_PRESSURE
+};
+
+typedef struct axis_name {
+        const char *name; /* Lowercase name without ABS_ */
+        int code; /* ABS_* code */
+} axis_name;
+
+/* Axes the abs= term of -n knows by name. */
+static const axis_name axis_names[] = {
+        {"x", ABS_X},
+        {"y", ABS_Y},
+        {"pressure", ABS_PRESSURE},
+        {"mt_slot", ABS_MT_SLOT},
+        {"mt_touch_major", ABS_MT_TOUCH_MAJOR},
+        {"mt_position_x", ABS_MT_POSITION_X},
+        {"mt_position_y", ABS_MT_POSITION_Y},
+        {"mt_tool_type", ABS_MT_TOOL_TYPE},
+        {"mt_tracking_id", ABS_MT_TRACKING_ID},
+        {"mt_pressure", ABS_MT_PRESSURE},
+        {"mt_distance", ABS_MT_DISTANCE},
+};
+
+/* Upper bounds of the frame latency histogram buckets, in microseconds. */
+static const uint32_t latency_bounds[LATENCY_BUCKETS] = {
+        100, 250, 500, 1000, 2000, 4000, 8000, 16000, 32000, 64000
+};
+
+typedef struct trackscreen_stats {
+        uint64_t events_read; /* Input events read from the touchscreen */
+        uint64_t frames; /* Frames produced for the trackpad */
+        uint64_t frames_emitted; /* Frames sent on after resampling */
+        uint64_t events_suppressed; /* Events that changed nothing */
+        uint64_t frames_suppressed; /* Frames left with nothing to send */
+        uint64_t syscalls; /* Kernel transitions spent reading and writing */
+        uint64_t events_dropped; /* Events lost to a full report */
+        uint64_t syn_dropped; /* SYN_DROPPED events from the touchscreen */
+        uint64_t sidekey_transitions; /* Side key presses and releases */
+        uint64_t frames_coalesced; /* Frames merged into a queued frame */
+        uint64_t output_blocked; /* Times a uinput device pushed back */
+        uint64_t output_dropped; /* Frames lost to a full queue or error */
+        uint64_t transitions_lost; /* Transition frames merged when full */
+        uint64_t reattaches; /* Times the touchscreen came back */
+        uint64_t config_changes; /* Configs applied at runtime */
+        uint64_t latency[LATENCY_BUCKETS + 1]; /* Frame latency histogram */
+        uint64_t latency_sum; /* Total frame latency in microseconds */
+} trackscreen_stats;
+
+enum {
+        LOG_RECV, /* Raw touchscreen event */
+        LOG_FINGER, /* Multitap tool change: code is finger count */
+        LOG_SIDEKEY, /* Sidekey state change */
+        LOG_LOST, /* Trackpad event dropped, report was full */
+        LOG_WRITE_FAILED, /* uinput write failed: value is the errno */
+};
+
+typedef struct log_record {
+        struct timeval time; /* Kernel timestamp of the triggering event */
+        uint8_t kind; /* LOG_* */
+        uint16_t type; /* Event type */
+        uint16_t code; /* Event code */
+        int32_t value; /* Event value */
+} log_record;
+
+typedef struct event_ring {
+        struct input_event *events; /* Storage, size entries */
+        uint32_t size; /* Capacity, a power of two */
+        uint32_t head; /* Total events ever appended */
+} event_ring;
+
+typedef struct frame_trace {
+        uint64_t read_begin; /* Kernel timestamp of the frame */
+        uint64_t read_end; /* Read of the batch holding the frame returned */
+        uint64_t state_begin; /* Started on the frame's events */
+        uint64_t state_end; /* Reached the SYN_REPORT */
+        uint64_t gesture_end; /* Finger count and multitap done */
+        uint64_t bounds_end; /* Clamping and side key routing done */
+        uint64_t write_end; /* Frame handed to uinput */
+} frame_trace;
+
+typedef struct perf_counter_info {
+        uint32_t type; /* perf_event_attr type */
+        uint64_t config; /* perf_event_attr config */
+        const char *name; /* Name used in stats and metrics */
+} perf_counter_info;
+
+typedef struct rate_analyzer {
+        int64_t window_start; /* Timestamp the current window began */
+        int64_t last_report; /* Timestamp of the previous SYN_REPORT */
+        uint64_t frames; /* Intervals measured this window */
+        uint64_t gaps; /* Intervals too long to be panel scans */
+        int64_t busy_usec; /* Sum of the measured intervals */
+        double mean; /* Running mean interval */
+        double m2; /* Running sum of squared deviations */
+        int64_t min; /* Shortest interval */
+        int64_t max; /* Longest interval */
+        uint64_t intervals[ANALYZE_BUCKETS]; /* Interval histogram */
+        uint64_t *slot_updates; /* Frames updating each slot */
+        uint64_t syn_dropped_start; /* SYN_DROPPED count at window start */
+} rate_analyzer;
+
+typedef struct uring {
+        int fd; /* io_uring file descriptor */
+        void *sq_ring; /* Submission queue ring mapping */
+        size_t sq_ring_size; /* Size of the submission ring mapping */
+        void *cq_ring; /* Completion queue ring mapping */
+        size_t cq_ring_size; /* Size of the completion ring mapping */
+        struct io_uring_sqe *sqes; /* Submission queue entries */
+        size_t sqes_size; /* Size of the SQE mapping */
+        unsigned int *sq_head; /* Kernel's submission head */
+        unsigned int *sq_ktail; /* Shared submission tail */
+        unsigned int *sq_mask; /* Submission ring mask */
+        unsigned int *sq_array; /* Submission index array */
+        unsigned int sq_entries; /* Submission ring size */
+        unsigned int sq_tail; /* Local tail, published on submit */
+        unsigned int to_submit; /* SQEs queued since the last submit */
+        unsigned int *cq_head; /* Completion head */
+        unsigned int *cq_tail; /* Kernel's completion tail */
+        unsigned int *cq_mask; /* Completion ring mask */
+        struct io_uring_cqe *cqes; /* Completion queue entries */
+        int read_armed; /* A touchscreen read is outstanding */
+        int read_done; /* The touchscreen read completed */
+        int read_result; /* Result of the completed read */
+        uint32_t read_generation; /* ts_generation the read was armed for */
+        int poll_armed; /* A poll on the epoll descriptor is outstanding */
+        int poll_done; /* The epoll descriptor became readable */
+        unsigned int writes_inflight; /* Writes queued but not completed */
+        int read_cancelled; /* The outstanding read is being cancelled */
+} uring;
+
+enum {
+        OUTPUT_TRACKPAD,
+        OUTPUT_KEYBOARD,
+        OUTPUT_COUNT
+};
+
+typedef struct output_frame {
+        struct input_event *events; /* Ends in SYN_REPORT */
+        uint32_t size; /* Room in events */
+        uint32_t count; /* Valid events */
+        int transition; /* Has key or tracking ID changes */
+        int start_slot; /* Device slot before the frame */
+} output_frame;
+
+typedef struct output_queue {
+        int id; /* OUTPUT_*, tags io_uring completions */
+        int fd; /* uinput descriptor */
+        output_frame frames[OUTPUT_QUEUE_FRAMES]; /* Frames not yet written */
+        uint32_t head; /* Oldest queued frame */
+        uint32_t tail; /* Next free frame */
+        size_t offset; /* Bytes of the head frame already written */
+        uint32_t inflight; /* Frames handed to io_uring */
+        int blocked; /* Waiting for the retry timer */
+        int slot; /* Device slot once the queue is written */
+        event_ring *flight; /* Flight recorder for written frames */
+} output_queue;
+
+typedef struct device_matcher {
+        char *terms; /* Copy of the -n argument the fields point into */
+        const char *name; /* Name, or glob unless exact, NULL for any */
+        int exact; /* name is a plain name, not a glob */
+        int vendor; /* Vendor ID, -1 for any */
+        int product; /* Product ID, -1 for any */
+        const char *phys; /* Glob on the physical path, NULL for any */
+        const char *uniq; /* Glob on the unique ID, NULL for any */
+        int abs[MATCHER_AXES]; /* ABS_* axes the device must report */
+        int abs_count; /* Valid entries in abs */
+        int word_bits; /* Bits per sysfs bitmap word, the kernel's long */
+} device_matcher;
+
+/*
+ * Where one touchscreen axis lands on the trackpad: the transform's only
+ * non-zero entry for it, and the trackpad axis it moves.
+ */
+typedef struct axis_map {
+        int64_t gain; /* Transform entry, 16.16 */
+        int64_t offset; /* Transform constant of the trackpad axis, 16.16 */
+        int limit; /* Largest trackpad value a touch clamps to */
+        int axis; /* Trackpad axis, 0 for X or 1 for Y */
+} axis_map;
+
+/*
+ * Settings that can change at runtime through the control socket or a
+ * config file reload. The derived fields and the stages are filled in by
+ * compile_config(), off the hot path, and a new config only replaces the
+ * live one between frames.
+ */
+typedef struct trackpad_config {
+        int left_percent; /* Percent from the left trackpad should start */
+        int top_percent; /* Percent from the top trackpad should start */
+        int width_percent; /* Width of the trackpad as percent of TS. */
+        int height_percent; /* Height of tp as percent of touchscreen. */
+        int32_t left_mm; /* Used instead of the percents unless 0, 16.16 */
+        int32_t top_mm;
+        int32_t width_mm;
+        int32_t height_mm;
+        int32_t scale; /* trackpad_delta = touchpad_delta * scale, 16.16 */
+        int frame_interval; /* Minimum usec between motion frames, or 0 */
+        int keycode[2]; /* Keyboard keycode for side palm touches. */
+        int rotation; /* Clockwise degrees the screen is turned */
+        int flip; /* FLIP_X and FLIP_Y, mirroring after the rotation */
+        int min_x; /* Trackpad left edge, in turned touchscreen units */
+        int min_y; /* Trackpad top edge, in turned touchscreen units */
+        int max_x; /* Trackpad right edge, in turned touchscreen units */
+        int max_y; /* Trackpad bottom edge, in turned touchscreen units */
+        int64_t gain_x; /* Touchscreen to trackpad X units, 16.16 */
+        int64_t gain_y; /* Touchscreen to trackpad Y units, 16.16 */
+        /* Touchscreen x, y, 1 to trackpad X and Y, 16.16 */
+        int64_t transform[2][3];
+        axis_map map[2]; /* The transform by touchscreen x and y */
+        int64_t right_edge; /* Trackpad X of the right edge, 16.16 */
+        /* Hands a finished frame to the trackpad, resampled or not. */
+        void (*send_frame)(trackscreen_context *ctx,
+                           const struct input_event *events,
+                           uint32_t count);
+
+        /* Presses and releases the side keys. */
+        void (*route_sides)(trackscreen_context *ctx);
+
+        /* Adds a written frame to the latency histogram. */
+        void (*record_latency)(trackscreen_context *ctx,
+                               const struct input_event *report);
+} trackpad_config;
+
+/*
+ * Control socket protocol. Each message is one control_message, and gets
+ * one back with status 0, CONTROL_PENDING or a negative errno, and the
+ * values that are now in effect for the command. CONTROL_PENDING means
+ * the change was accepted but waits for the old keyboard to finish
+ * writing, so the values are still the ones before it.
+ */
+#define CONTROL_PENDING 1
+
+enum {
+        CONTROL_REGION = 1, /* left, top, width, height percent */
+        CONTROL_SCALE, /* Motion gain, 16.16 fixed point */
+        CONTROL_FRAME_INTERVAL, /* Microseconds, 0 to stop resampling */
+        CONTROL_KEYCODES, /* Left and right side key codes */
+        CONTROL_REGION_MM, /* left, top, width, height mm, 16.16 */
+        CONTROL_ORIENTATION, /* Rotation in degrees, FLIP_* bits */
+};
+
+typedef struct control_message {
+        uint32_t command; /* CONTROL_* */
+        int32_t status; /* Reply: 0, CONTROL_PENDING or a negative errno */
+        int32_t values[4]; /* Arguments, or in a reply what's in effect */
+} control_message;
+
+/* A config file key, and the command line option it stands for. */
+typedef struct config_setting {
+        const char *section; /* [section] the key belongs to */
+        const char *key; /* Name before the = */
+        int option; /* Option given the value */
+        int has_arg; /* no_argument, required_argument or optional_argument */
+        int per_device; /* Can be set in a --profiles file */
+} config_setting;
+
+/* What --cache remembers about the touchscreen between runs. */
+typedef struct device_cache {
+        uint32_t magic; /* CACHE_MAGIC */
+        uint32_t size; /* sizeof(device_cache), catches layout changes */
+        int use_name; /* match is a -n argument, not a path */
+        char match[256]; /* Device argument the entry was found from */
+        char node[256]; /* Device node it resolved to */
+        uint64_t rdev; /* Device number of node */
+        struct input_id id; /* Bus, vendor, product and version */
+        char name[256]; /* Touchscreen name */
+        char phys[256]; /* Touchscreen physical path */
+        int32_t min_x; /* ABS_X range and resolution */
+        int32_t max_x;
+        int32_t x_res;
+        int32_t min_y; /* ABS_Y range and resolution */
+        int32_t max_y;
+        int32_t y_res;
+        int32_t pressure_min; /* ABS_PRESSURE range */
+        int32_t pressure_max;
+        uint32_t slot_count; /* ABS_MT_SLOT maximum plus one */
+} device_cache;
+
+/*
+ * Leads the upgrade state, and never changes layout, so a binary that
+ * can't use the rest can still tell and close what it was handed.
+ */
+typedef struct upgrade_header {
+        uint32_t magic; /* UPGRADE_MAGIC */
+        uint32_t version; /* UPGRADE_VERSION */
+        int ts; /* Inherited descriptors */
+        int tp;
+        int kbd;
+        uint32_t state_size; /* sizeof(upgrade_state) */
+        uint32_t finger_size; /* sizeof(finger) */
+        uint32_t emitted_size; /* sizeof(*emitted_mt) */
+        uint32_t mask_size; /* Bytes per slot mask word */
+        uint32_t event_size; /* sizeof(struct input_event) */
+} upgrade_header;
+
+/*
+ * Handed to the new process on a hot upgrade, followed by the finger
+ * table, the emitted MT values, the active, dirty, left and right slot
+ * masks and the report in progress.
+ */
+typedef struct upgrade_state {
+        upgrade_header header; /* What follows, and the descriptors */
+        device_cache device; /* Touchscreen identity and axes */
+        int monotonic_events; /* Touchscreen timestamps use CLOCK_MONOTONIC */
+        unsigned int slot; /* Touchscreen slot selected */
+        int finger_count; /* Number of active slots */
+        unsigned int sidekey; /* Side keys held down */
+        int emitted_slot; /* Last slot selected on the trackpad */
+        int32_t emitted_abs[ABS_MT_SLOT]; /* Last value sent per axis */
+        int output_slot[OUTPUT_COUNT]; /* Device slot per uinput device */
+        int input_events; /* Report in progress, sent after the masks */
+        trackpad_config config; /* Settings, as changed at runtime */
+        int tp_range_x; /* Trackpad axis ranges */
+        int tp_range_y;
+        int32_t tp_scale; /* Scale the trackpad was created with */
+} upgrade_state;
+
+struct trackscreen_context {
+        int ts; /* Touchscreen file descriptor, -1 while unplugged */
+        struct input_id ts_id; /* Touchscreen bus, vendor and product */
+        char ts_name[256]; /* Touchscreen name */
+        dev_t ts_rdev; /* Touchscreen device number */
+        char ts_node[256]; /* Touchscreen device node */
+        uint32_t ts_generation; /* Bumped on every detach and attach */
+        uint64_t detach_time; /* When the touchscreen went away */
+        struct udev *udev; /* libudev context */
+        struct udev_monitor *udev_monitor; /* Input hotplug events */
+        loop_source hotplug_source; /* udev monitor */
+        const char *device_path; /* Touchscreen path, or what -n matches */
+        int use_name; /* device_path is for -n */
+        device_matcher matcher; /* What -n looks for */
+        int wait_timeout; /* --wait seconds, -1 forever, 0 to not wait */
         int tp; /* Trackpad file descriptor */
         int kbd; /* Fake keyboard file descriptor */
-        int keycode[2]; /* Keyboard keycode for side palm touches. */
         int ts_min_x; /* Minimum touchscreen X coordinate */
         int ts_min_y; /* Minimum touchscreen Y coordinate */
         int ts_max_x; /* Maximum touchscreen X coordinate */
         int ts_max_y; /* Maximum touchscreen Y coordinate */
         int x_res; /* X axis resolution */
         int y_res; /* Y axis resolution */
-        int tp_left_percent; /* Percent from the left trackpad should start */
-        int tp_top_percent; /* Percent from the top trackpad should start */
-        int tp_width_percent; /* Width of the trackpad as percent of TS. */
-        int tp_height_percent; /* Height of tp as percent of touchscreen. */
-        int tp_min_x; /* Minimum trackpad X coordinate */
-        int tp_min_y; /* Minimum trackpad Y coordinate */
-        int tp_max_x; /* Maximum trackpad X coordinate */
-        int tp_max_y; /* Maximum trackpad Y coordinate */
+        trackpad_config config; /* Settings the hot path runs with */
+        trackpad_config staged; /* Settings to switch to between frames */
+        int config_staged; /* staged is waiting to be applied */
+        int tp_range_x; /* Trackpad X axis range, fixed at creation */
+        int tp_range_y; /* Trackpad Y axis range, fixed at creation */
+        int32_t tp_scale; /* Scale in the trackpad resolution, 16.16 */
         int pressure_min; /* Minimum pressure */
         int pressure_max; /* Maximum pressure */
         int finger_count; /* Number of slots with a valid tracking ID */
-        finger fingers[MAX_FINGERS]; /* State of all fingers down */
+        unsigned int slot_count; /* Touchscreen slots, from ABS_MT_SLOT */
+        unsigned int slot_words; /* 64-bit words in a slot bitmask */
+        finger *fingers; /* State of every slot */
+        uint64_t *active_slots; /* Slots with a valid tracking ID */
+        uint64_t *dirty_slots; /* Slots whose trackpad X may have moved */
+        uint64_t *left_slots; /* Active slots left of the trackpad */
+        uint64_t *right_slots; /* Active slots right of the trackpad */
+        int32_t *resync_values; /* EVIOCGMTSLOTS buffers, per resync axis */
         unsigned int slot; /* currently selected slot */
-        double scale; /* touchpad_delta * scale = trackpad_delta */
         int verbose; /* Print stuff! */
-        struct input_event input_event[MAX_EVENTS_PER_REPORT]; /* Events this report */
+        uint32_t report_size; /* Events a report can hold, from slot_count */
+        /* Events this report, plus room for the SYN_REPORT itself. */
+        struct input_event *input_event;
         int input_events; /* Valid events in this report */
+        /* This report with unchanged values dropped and slots inserted. */
+        struct input_event *output_event;
+        struct input_event *frame_events; /* Behind the output frames */
+        unsigned int filter_slot; /* Slot of the events being filtered */
+        int emitted_slot; /* Last slot selected on the trackpad */
+        int32_t emitted_abs[ABS_MT_SLOT]; /* Last value sent per axis */
+        int32_t (*emitted_mt)[MT_AXES]; /* Per slot, per MT axis */
         unsigned int sidekey; /* Current sidekey state (bit 0 left, bit 1 right). */
-} trackscreen_context;
+        int epfd; /* Event loop epoll descriptor */
+        int sigfd; /* signalfd for termination signals */
+        int quit; /* Set to leave the event loop cleanly */
+        int upgrade_pending; /* Re-exec once the outputs are idle */
+        char **argv; /* Command line, re-executed by hot upgrades */
+        int inherit_fd; /* State from the process we replaced, or -1 */
+        int use_uring; /* Try the io_uring backend first */
+        uring *ring; /* io_uring backend, or NULL for epoll and read */
+        const char *backend; /* Name of the I/O backend in use */
+        loop_source ts_source; /* Touchscreen, when not read by io_uring */
+        loop_source signal_source; /* Termination signals */
+        loop_source retry_source; /* Timer retrying blocked output */
+        output_queue outputs[OUTPUT_COUNT]; /* Per uinput device queues */
+        loop_source frame_source; /* Timer releasing held motion */
+        int frame_timer_armed; /* The frame timer is ticking */
+        output_frame held_frame; /* Motion waiting for the next tick */
+        int frame_held; /* held_frame is valid */
+        int held_slot; /* Device slot after held_frame */
+        struct input_event read_buffer[MAX_EVENTS_PER_READ]; /* Batch read */
+        trackscreen_stats stats; /* Counters reported on exit */
+        int rt_priority; /* SCHED_FIFO priority, or 0 for SCHED_OTHER */
+        int pin_cpus; /* Restrict the process to cpus */
+        cpu_set_t cpus; /* CPUs to run on when pin_cpus is set */
+        struct rusage rusage_start; /* Resource usage entering the loop */
+        struct timeval event_time; /* Timestamp of the event being handled */
+        log_record *log_ring; /* Verbose records waiting to be printed */
+        uint32_t log_head; /* Next log record to write */
+        uint32_t log_tail; /* Next log record to print */
+        uint32_t log_dropped; /* Records overwritten before printing */
+        event_ring flight_in; /* Recent raw touchscreen events */
+        event_ring flight_tp; /* Recent events written to the trackpad */
+        event_ring flight_kbd; /* Recent events written to the keyboard */
+        const char *flight_dir; /* Directory for flight recorder dumps */
+        char *flight_device; /* evemu device description, from attach */
+        const char *flight_dump; /* Reason for a dump due when idle */
+        time_t flight_last_drop; /* When SYN_DROPPED last caused a dump */
+        const char *metrics_path; /* Unix socket serving metrics, or NULL */
+        loop_source metrics_source; /* Metrics listening socket */
+        const char *control_path; /* Unix socket for changes, or NULL */
+        loop_source control_source; /* Control listening socket */
+        loop_source control_client; /* Connected control client */
+        const char *config_path; /* -c file, or NULL */
+        char *config_text; /* Contents of the file, settings point into it */
+        const char *profile_dir; /* --profiles directory, or NULL */
+        char profile_path[PATH_MAX]; /* Touchscreen's profile, or empty */
+        char *profile_text; /* Contents of the profile */
+        loop_source config_watch; /* inotify on the files' directories */
+        int config_wd; /* Watch on the config file's directory, or -1 */
+        int profile_wd; /* Watch on the profile's directory, or -1 */
+        loop_source reload_signal; /* signalfd for SIGHUP */
+        int monotonic_events; /* Touchscreen timestamps use CLOCK_MONOTONIC */
+        const char *trace_path; /* Chrome trace output file, or NULL */
+        const char *cache_path; /* Device cache file, or NULL */
+        frame_trace *trace_frames; /* Ring of recent frame timings */
+        uint32_t trace_head; /* Total frames traced */
+        uint64_t trace_read_end; /* When the current batch was read */
+        uint64_t trace_frame_begin; /* When work on this frame started */
+        int trace_dump; /* Write the trace when idle */
+        int use_perf; /* Open perf counters for the event loop */
+        int perf_fd[PERF_COUNTERS]; /* perf_event_open descriptors */
+        int perf_group; /* First counter, which the others follow */
+        int64_t analyze_period; /* Analyzer window in usec, 0 if off */
+        int analyze_report; /* Print the analyzer report when idle */
+        uint64_t *analyze_slots; /* Slots with position updates this frame */
+        rate_analyzer analyzer; /* Report rate and jitter statistics */
+};
 
 #define CHECK_IOCTL(args...) \
         if (ioctl(args) < 0) { \
@@ -131,11 +718,42 @@ static int setup_pressure_axis(trackscreen_context *ctx,
         return 0;
 }
 
+/*
+ * Touchscreen units per millimetre, 16.16, for settings given in mm. A
+ * panel that reports no resolution is taken to have square units and to
+ * be FALLBACK_PANEL_WIDTH_MM wide, about a 13" laptop, which keeps mm
+ * settings in the right ballpark.
+ */
+static void panel_resolution(trackscreen_context *ctx,
+                             int64_t *res_x,
+                             int64_t *res_y) {
+
+        *res_x = (int64_t)ctx->x_res << 16;
+        *res_y = (int64_t)ctx->y_res << 16;
+        if (*res_x <= 0) {
+                *res_x = *res_y;
+        }
+
+        if (*res_x <= 0) {
+                *res_x = ((int64_t)(ctx->ts_max_x - ctx->ts_min_x) << 16) /
+                         FALLBACK_PANEL_WIDTH_MM;
+        }
+
+        if (*res_y <= 0) {
+                *res_y = *res_x;
+        }
+
+        return;
+}
+
 static int setup_trackpad(trackscreen_context *ctx) {
         int fd;
+        int64_t res;
+        int64_t res_x;
+        int64_t res_y;
         struct uinput_setup usetup;
 
-        ctx->tp = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+        ctx->tp = open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC);
         fd = ctx->tp;
         if (fd < 0) {
                 perror("Cannot open /dev/uinput");
@@ -162,29 +780,47 @@ static int setup_trackpad(trackscreen_context *ctx) {
         CHECK_IOCTL(fd, UI_SET_ABSBIT, ABS_MT_PRESSURE);
         CHECK_IOCTL(fd, UI_SET_PROPBIT, INPUT_PROP_POINTER);
         CHECK_IOCTL(fd, UI_SET_PROPBIT, INPUT_PROP_BUTTONPAD);
-        setup_axis(ctx, ABS_X, ctx->tp_max_x - ctx->tp_min_x, ctx->x_res);
-        setup_axis(ctx, ABS_Y, ctx->tp_max_y - ctx->tp_min_y, ctx->y_res);
+
+        /*
+         * Report a resolution even if the panel doesn't, for acceleration.
+         * Scaling it down makes the trackpad that much bigger to whatever
+         * turns positions into motion, which is how the scale gets past
+         * the trackpad's edges.
+         */
+        panel_resolution(ctx, &res_x, &res_y);
+        res_x = (((res_x << 1) / ctx->tp_scale) + 1) >> 1;
+        res_y = (((res_y << 1) / ctx->tp_scale) + 1) >> 1;
+        if (res_x == 0) {
+                res_x = 1;
+        }
+
+        if (res_y == 0) {
+                res_y = 1;
+        }
+
+        /* A quarter turn puts the touchscreen's y along the trackpad X. */
+        if (ctx->config.map[0].axis != 0) {
+                res = res_x;
+                res_x = res_y;
+                res_y = res;
+        }
+
+        setup_axis(ctx, ABS_X, ctx->tp_range_x, res_x);
+        setup_axis(ctx, ABS_Y, ctx->tp_range_y, res_y);
         setup_pressure_axis(ctx,
                             ABS_PRESSURE,
                             ctx->pressure_min,
                             ctx->pressure_max);
 
-        setup_axis(ctx,
-                   ABS_MT_POSITION_X,
-                   ctx->tp_max_x - ctx->tp_min_x,
-                   ctx->x_res);
-
-        setup_axis(ctx,
-                   ABS_MT_POSITION_Y,
-                   ctx->tp_max_y - ctx->tp_min_y,
-                   ctx->y_res);
+        setup_axis(ctx, ABS_MT_POSITION_X, ctx->tp_range_x, res_x);
+        setup_axis(ctx, ABS_MT_POSITION_Y, ctx->tp_range_y, res_y);
 
         setup_pressure_axis(ctx,
                             ABS_MT_PRESSURE,
                             ctx->pressure_min,
                             ctx->pressure_max);
 
-        setup_axis(ctx, ABS_MT_SLOT, 9, 0);
+        setup_axis(ctx, ABS_MT_SLOT, ctx->slot_count - 1, 0);
         memset(&usetup, 0, sizeof(usetup));
         usetup.id.bustype = BUS_VIRTUAL;
         usetup.id.vendor = 0x0650; /* sample vendor */
@@ -199,7 +835,7 @@ static int setup_keyboard(trackscreen_context *ctx) {
         int fd;
         struct uinput_setup usetup;
 
-        ctx->kbd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+        ctx->kbd = open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC);
         fd = ctx->kbd;
         if (fd < 0) {
                 perror("Cannot open /dev/uinput");
@@ -207,8 +843,8 @@ static int setup_keyboard(trackscreen_context *ctx) {
         }
 
         CHECK_IOCTL(fd, UI_SET_EVBIT, EV_KEY);
-        CHECK_IOCTL(fd, UI_SET_KEYBIT, ctx->keycode[0]);
-        CHECK_IOCTL(fd, UI_SET_KEYBIT, ctx->keycode[1]);
+        CHECK_IOCTL(fd, UI_SET_KEYBIT, ctx->config.keycode[0]);
+        CHECK_IOCTL(fd, UI_SET_KEYBIT, ctx->config.keycode[1]);
         memset(&usetup, 0, sizeof(usetup));
         usetup.id.bustype = BUS_VIRTUAL;
         usetup.id.vendor = 0x0650; /* sample vendor */
@@ -222,6 +858,12 @@ static int setup_keyboard(trackscreen_context *ctx) {
 static int read_touchscreen_parameters(trackscreen_context *ctx) {
         struct input_absinfo abs;
 
+        /* Remembered to recognise the touchscreen if it comes back. */
+        ioctl(ctx->ts, EVIOCGID, &(ctx->ts_id));
+        ioctl(ctx->ts,
+              EVIOCGNAME(sizeof(ctx->ts_name) - 1),
+              ctx->ts_name);
+
         if (ioctl(ctx->ts, EVIOCGABS(ABS_X), &abs)) {
                 perror("Cannot get touchscreen X info");
                 return -1;
@@ -245,629 +887,6737 @@ static int read_touchscreen_parameters(trackscreen_context *ctx) {
 
         ctx->pressure_min = abs.minimum;
         ctx->pressure_max = abs.maximum;
+
+        /* Single touch panels have no slot axis; treat them as one slot. */
+        ctx->slot_count = 1;
+        if ((ioctl(ctx->ts, EVIOCGABS(ABS_MT_SLOT), &abs) == 0) &&
+            (abs.maximum > 0)) {
+
+                ctx->slot_count = abs.maximum + 1;
+        }
+
+        /* Touches in the slots past the cap are ignored. */
+        if (ctx->slot_count > MAX_SLOTS) {
+                fprintf(stderr,
+                        "Touchscreen has %u slots, only using %d\n",
+                        ctx->slot_count,
+                        MAX_SLOTS);
+
+                ctx->slot_count = MAX_SLOTS;
+        }
+
         if (ctx->verbose) {
                 printf("Touchscreen X [%d - %d], Y [%d - %d], "
-                       "Pressure [%d - %d]\n",
+                       "Pressure [%d - %d], %u slots\n",
                        ctx->ts_min_x,
                        ctx->ts_max_x,
                        ctx->ts_min_y,
                        ctx->ts_max_y,
                        ctx->pressure_min,
-                       ctx->pressure_max);
+                       ctx->pressure_max,
+                       ctx->slot_count);
         }
 
         return 0;
 }
 
-static void compute_trackpad_bounds(trackscreen_context *ctx) {
-        int height;
-        int width;
-
-        height = ctx->ts_max_y - ctx->ts_min_y;
-        width = ctx->ts_max_x - ctx->ts_min_x;
-
-        /* In a 3x3 grid, put the trackpad in the bottom middle. */
-        ctx->tp_min_x = ctx->ts_min_x + (width * ctx->tp_left_percent / 100);
-        ctx->tp_max_x = ctx->tp_min_x + (width * ctx->tp_width_percent / 100);
-        ctx->tp_min_y = ctx->ts_min_y + (height * ctx->tp_top_percent / 100);
-        ctx->tp_max_y = ctx->tp_min_y +
-                        (height * ctx->tp_height_percent / 100);
-
-        if (ctx->verbose) {
-                printf("Trackpad X [%d - %d], Y [%d - %d]\n",
-                       ctx->tp_min_x,
-                       ctx->tp_max_x,
-                       ctx->tp_min_y,
-                       ctx->tp_max_y);
-        }
-
+/* Record what read_touchscreen_parameters() found, for reuse later. */
+static void device_cache_fill(trackscreen_context *ctx, device_cache *cache) {
+        memset(cache, 0, sizeof(*cache));
+        cache->magic = CACHE_MAGIC;
+        cache->size = sizeof(*cache);
+        snprintf(cache->node, sizeof(cache->node), "%s", ctx->ts_node);
+        cache->rdev = ctx->ts_rdev;
+        cache->id = ctx->ts_id;
+        snprintf(cache->name, sizeof(cache->name), "%s", ctx->ts_name);
+        ioctl(ctx->ts, EVIOCGPHYS(sizeof(cache->phys) - 1), cache->phys);
+        cache->min_x = ctx->ts_min_x;
+        cache->max_x = ctx->ts_max_x;
+        cache->x_res = ctx->x_res;
+        cache->min_y = ctx->ts_min_y;
+        cache->max_y = ctx->ts_max_y;
+        cache->y_res = ctx->y_res;
+        cache->pressure_min = ctx->pressure_min;
+        cache->pressure_max = ctx->pressure_max;
+        cache->slot_count = ctx->slot_count;
         return;
 }
 
-static void queue_tp_event(trackscreen_context *ctx,
-                           uint16_t type,
-                           uint16_t code,
-                           int32_t value) {
+/* The reverse, in place of read_touchscreen_parameters(). */
+static void device_cache_apply(trackscreen_context *ctx,
+                               device_cache *cache) {
+
+        cache->node[sizeof(cache->node) - 1] = '\0';
+        cache->name[sizeof(cache->name) - 1] = '\0';
+        snprintf(ctx->ts_node, sizeof(ctx->ts_node), "%s", cache->node);
+        ctx->ts_rdev = cache->rdev;
+        ctx->ts_id = cache->id;
+        snprintf(ctx->ts_name, sizeof(ctx->ts_name), "%s", cache->name);
+        ctx->ts_min_x = cache->min_x;
+        ctx->ts_max_x = cache->max_x;
+        ctx->x_res = cache->x_res;
+        ctx->ts_min_y = cache->min_y;
+        ctx->ts_max_y = cache->max_y;
+        ctx->y_res = cache->y_res;
+        ctx->pressure_min = cache->pressure_min;
+        ctx->pressure_max = cache->pressure_max;
+        ctx->slot_count = cache->slot_count;
+        return;
+}
 
-        struct input_event *ev;
+/*
+ * Slot tables are sized from the touchscreen's ABS_MT_SLOT range. Sets of
+ * slots are bitmasks of slot_words 64-bit words, so per-frame loops only
+ * visit the slots that matter.
+ */
+static int allocate_slots(trackscreen_context *ctx) {
+        uint32_t frame_size;
+        uint32_t index;
+        struct input_event *next;
+        output_queue *queue;
+        unsigned int slot;
+
+        /*
+         * A report can change every axis of every slot. Filtered, it
+         * loses its own slot switches and gains at most one more, plus
+         * the SYN_REPORT, which is what an output frame has to hold. The
+         * keyboard only ever gets a few events at a time.
+         */
+        ctx->report_size = REPORT_DEVICE_EVENTS +
+                           (ctx->slot_count * REPORT_SLOT_EVENTS);
+
+        frame_size = ctx->report_size + 2;
+        ctx->input_event = calloc(ctx->report_size + 1,
+                                  sizeof(struct input_event));
+
+        ctx->output_event = calloc(frame_size, sizeof(struct input_event));
+        ctx->frame_events = calloc(((OUTPUT_QUEUE_FRAMES + 1) * frame_size) +
+                                   (OUTPUT_QUEUE_FRAMES * OUTPUT_FRAME_EVENTS),
+                                   sizeof(struct input_event));
+
+        ctx->slot_words = (ctx->slot_count + 63) / 64;
+        ctx->fingers = calloc(ctx->slot_count, sizeof(finger));
+        ctx->emitted_mt = calloc(ctx->slot_count, sizeof(*ctx->emitted_mt));
+        ctx->active_slots = calloc(ctx->slot_words, sizeof(uint64_t));
+        ctx->dirty_slots = calloc(ctx->slot_words, sizeof(uint64_t));
+        ctx->left_slots = calloc(ctx->slot_words, sizeof(uint64_t));
+        ctx->right_slots = calloc(ctx->slot_words, sizeof(uint64_t));
+        ctx->resync_values = calloc(RESYNC_AXES * (ctx->slot_count + 1),
+                                    sizeof(int32_t));
+
+        ctx->analyze_slots = calloc(ctx->slot_words, sizeof(uint64_t));
+        ctx->analyzer.slot_updates = calloc(ctx->slot_count,
+                                            sizeof(uint64_t));
+
+        if ((ctx->fingers == NULL) ||
+            (ctx->emitted_mt == NULL) ||
+            (ctx->active_slots == NULL) ||
+            (ctx->dirty_slots == NULL) ||
+            (ctx->left_slots == NULL) ||
+            (ctx->right_slots == NULL) ||
+            (ctx->resync_values == NULL) ||
+            (ctx->analyze_slots == NULL) ||
+            (ctx->analyzer.slot_updates == NULL) ||
+            (ctx->input_event == NULL) ||
+            (ctx->output_event == NULL) ||
+            (ctx->frame_events == NULL)) {
+
+                fprintf(stderr, "Cannot allocate %u slots\n", ctx->slot_count);
+                return -1;
+        }
 
-        if (ctx->input_events >= MAX_EVENTS_PER_REPORT) {
-                if (ctx->verbose) {
-                        fprintf(stderr, "Lost event\n");
-                }
+        next = ctx->frame_events;
+        ctx->held_frame.events = next;
+        ctx->held_frame.size = frame_size;
+        next += frame_size;
+        for (index = 0; index < OUTPUT_QUEUE_FRAMES; index += 1) {
+                queue = &(ctx->outputs[OUTPUT_TRACKPAD]);
+                queue->frames[index].events = next;
+                queue->frames[index].size = frame_size;
+                next += frame_size;
+                queue = &(ctx->outputs[OUTPUT_KEYBOARD]);
+                queue->frames[index].events = next;
+                queue->frames[index].size = OUTPUT_FRAME_EVENTS;
+                next += OUTPUT_FRAME_EVENTS;
+        }
 
-                return;
+        for (slot = 0; slot < ctx->slot_count; slot += 1) {
+                ctx->fingers[slot].tracking_id = -1;
+                ctx->emitted_mt[slot][MT_AXIS(ABS_MT_TRACKING_ID)] = -1;
         }
 
-        ev = &(ctx->input_event[ctx->input_events]);
-        ctx->input_events += 1;
-        ev->type = type;
-        ev->code = code;
-        ev->value = value;
-        return;
+        return 0;
 }
 
-static void flush_tp_events(trackscreen_context *ctx,
-                            struct input_event *report) {
+/* Free the slot tables, leaving them ready to be allocated again. */
+static void free_slots(trackscreen_context *ctx) {
+        free(ctx->fingers);
+        free(ctx->emitted_mt);
+        free(ctx->active_slots);
+        free(ctx->dirty_slots);
+        free(ctx->left_slots);
+        free(ctx->right_slots);
+        free(ctx->resync_values);
+        free(ctx->analyze_slots);
+        free(ctx->analyzer.slot_updates);
+        free(ctx->input_event);
+        free(ctx->output_event);
+        free(ctx->frame_events);
+        ctx->fingers = NULL;
+        ctx->emitted_mt = NULL;
+        ctx->active_slots = NULL;
+        ctx->dirty_slots = NULL;
+        ctx->left_slots = NULL;
+        ctx->right_slots = NULL;
+        ctx->resync_values = NULL;
+        ctx->analyze_slots = NULL;
+        ctx->analyzer.slot_updates = NULL;
+        ctx->input_event = NULL;
+        ctx->output_event = NULL;
+        ctx->frame_events = NULL;
+        return;
+}
 
-        size_t size;
+static void slot_set(uint64_t *mask, unsigned int slot) {
+        mask[slot / 64] |= 1ULL << (slot % 64);
+        return;
+}
 
-        size = ctx->input_events * sizeof(struct input_event);
-        write(ctx->tp, &(ctx->input_event[0]), size);
-        ctx->input_events = 0;
-        write(ctx->tp, report, sizeof(*report));
+static void slot_clear(uint64_t *mask, unsigned int slot) {
+        mask[slot / 64] &= ~(1ULL << (slot % 64));
         return;
 }
 
-static void emit_sidekey_event(trackscreen_context *ctx,
-                               int32_t value) {
+static unsigned int slot_popcount(trackscreen_context *ctx,
+                                  const uint64_t *mask) {
 
-        struct input_event ev[3];
-        size_t evcount;
+        unsigned int count;
+        unsigned int word;
 
-        evcount = 0;
-        if (((value ^ ctx->sidekey) & 0x1) != 0) {
-                ev[evcount].type = EV_KEY;
-                ev[evcount].code = ctx->keycode[0];
-                ev[evcount].value = !!(value & 0x1);
-                evcount += 1;
+        count = 0;
+        for (word = 0; word < ctx->slot_words; word += 1) {
+                count += __builtin_popcountll(mask[word]);
         }
 
-        if (((value ^ ctx->sidekey) & 0x2) != 0) {
-                ev[evcount].type = EV_KEY;
-                ev[evcount].code = ctx->keycode[1];
-                ev[evcount].value = !!(value & 0x2);
-                evcount += 1;
+        return count;
+}
+
+/* Return the first slot in mask at or after slot, or slot_count if none. */
+static unsigned int slot_next(trackscreen_context *ctx,
+                              const uint64_t *mask,
+                              unsigned int slot) {
+
+        uint64_t bits;
+        unsigned int word;
+
+        word = slot / 64;
+        if (word >= ctx->slot_words) {
+                return ctx->slot_count;
         }
 
-        if (evcount == 0) {
-                return;
+        bits = mask[word] & (~0ULL << (slot % 64));
+        while (bits == 0) {
+                word += 1;
+                if (word >= ctx->slot_words) {
+                        return ctx->slot_count;
+                }
+
+                bits = mask[word];
         }
 
-        ev[evcount].type = EV_SYN;
-        ev[evcount].code = SYN_REPORT;
-        ev[evcount].value = 0;
-        evcount += 1;
-        write(ctx->kbd, ev, sizeof(ev[0]) * evcount);
-        ctx->sidekey = value;
-        if (ctx->verbose) {
-                printf("Sidekey: %x\n", value);
+        return (word * 64) + __builtin_ctzll(bits);
+}
+
+/* An offset or size along an axis: mm if given, or else percent of span. */
+static int region_units(int span, int percent, int32_t mm, int64_t res) {
+        if (mm != 0) {
+                return ((int64_t)mm * res) >> 32;
         }
 
-        return;
+        return span * percent / 100;
 }
 
-static void check_bounds(trackscreen_context *ctx) {
-        struct input_event *ev;
-        int index;
-        int side_touches;
-        int x;
-        int y;
+/*
+ * Work out the rectangle in touchscreen units, as seen once the screen is
+ * turned and mirrored. Millimetres are converted here, once per config,
+ * so the hot path stays in integer device units. A rectangle in mm can
+ * run past a smaller panel; it's cut off at the edge, but must not miss
+ * the panel entirely.
+ *
+ * The rotation, mirroring, rectangle and gain then fold into one 16.16
+ * affine transform from touchscreen x and y to trackpad X and Y. The
+ * orientations here only ever swap and reverse axes, so each touchscreen
+ * axis moves exactly one trackpad axis. Returns 0 or -1.
+ */
+static int compute_trackpad_bounds(trackscreen_context *ctx,
+                                   trackpad_config *config) {
+
+        int axis;
+        int64_t gain[2];
+        int high[2];
+        int64_t limit;
+        int low[2];
+        axis_map *map;
+        int range[2];
+        int64_t res[2];
+        int reverse[2];
+        int64_t scale;
+        int source[2];
+        int span[2];
+        int ts_max[2];
+        int ts_min[2];
+        int turns;
+
+        ts_min[0] = ctx->ts_min_x;
+        ts_min[1] = ctx->ts_min_y;
+        ts_max[0] = ctx->ts_max_x;
+        ts_max[1] = ctx->ts_max_y;
+        panel_resolution(ctx, &(res[0]), &(res[1]));
+
+        /*
+         * Turning clockwise, the trackpad X runs along the touchscreen's
+         * x, then down its y, then back along x, then up y.
+         */
+        turns = config->rotation / 90;
+        source[0] = turns & 1;
+        source[1] = !source[0];
+        reverse[0] = (turns >= 2);
+        reverse[1] = (turns == 1) || (turns == 2);
+        reverse[0] ^= ((config->flip & FLIP_X) != 0);
+        reverse[1] ^= ((config->flip & FLIP_Y) != 0);
+        for (axis = 0; axis < 2; axis += 1) {
+                span[axis] = ts_max[source[axis]] - ts_min[source[axis]];
+        }
 
-        /* Compute the side touches. */
-        side_touches = 0;
-        for (index = 0; index < MAX_FINGERS; index += 1) {
-                if (ctx->fingers[index].tracking_id < 0) {
-                        continue;
+        /* In a 3x3 grid, put the trackpad in the bottom middle. */
+        low[0] = region_units(span[0],
+                              config->left_percent,
+                              config->left_mm,
+                              res[source[0]]);
+
+        high[0] = low[0] + region_units(span[0],
+                                        config->width_percent,
+                                        config->width_mm,
+                                        res[source[0]]);
+
+        low[1] = region_units(span[1],
+                              config->top_percent,
+                              config->top_mm,
+                              res[source[1]]);
+
+        high[1] = low[1] + region_units(span[1],
+                                        config->height_percent,
+                                        config->height_mm,
+                                        res[source[1]]);
+
+        for (axis = 0; axis < 2; axis += 1) {
+                if (high[axis] > span[axis]) {
+                        high[axis] = span[axis];
                 }
 
-                if (ctx->fingers[index].pos.x < ctx->tp_min_x) {
-                        side_touches |= 0x1;
+                if (low[axis] >= high[axis]) {
+                        fprintf(stderr,
+                                "Trackpad region is off the touchscreen\n");
 
-                } else if (ctx->fingers[index].pos.x >= ctx->tp_max_x) {
-                        side_touches |= 0x2;
+                        return -1;
                 }
         }
 
-        if ((side_touches != ctx->sidekey) && (ctx->kbd > 0)) {
-                emit_sidekey_event(ctx, side_touches);
+        config->min_x = low[0];
+        config->max_x = high[0];
+        config->min_y = low[1];
+        config->max_y = high[1];
+
+        /*
+         * The first rectangle and scale size the trackpad's axes and
+         * resolution for good. Other rectangles, and a lower scale, are
+         * a gain onto that range.
+         */
+        if (ctx->tp_range_x == 0) {
+                ctx->tp_range_x = config->max_x - config->min_x;
+                ctx->tp_range_y = config->max_y - config->min_y;
+                ctx->tp_scale = config->scale;
+                if ((ctx->verbose) && (ctx->x_res <= 0) && (ctx->y_res <= 0)) {
+                        printf("No touchscreen resolution, taking it to be "
+                               "%d mm wide\n",
+                               FALLBACK_PANEL_WIDTH_MM);
+                }
         }
 
-        /* Adjust the positions */
-        ev = &(ctx->input_event[0]);
-        for (index = 0; index < ctx->input_events; index += 1) {
-                if (ev->type == EV_ABS) {
-                        if ((ev->code == ABS_X) ||
-                            (ev->code == ABS_MT_POSITION_X)) {
-
-                                /* Clamp and adjust x and y. */
-                                x = ev->value;
-                                if (x < ctx->tp_min_x) {
-                                        x = ctx->tp_min_x;
-
-                                } else if (x >= ctx->tp_max_x) {
-                                        x = ctx->tp_max_x - 1;
-                                }
-
-                                ev->value = x - ctx->tp_min_x;
-
-                        } else if ((ev->code == ABS_Y) ||
-                                   (ev->code == ABS_MT_POSITION_Y)) {
-
-                                /* Clamp and adjust y. */
-                                y = ev->value;
-                                if (y < ctx->tp_min_y) {
-                                        y = ctx->tp_min_y;
-
-                                } else if (y >= ctx->tp_max_y) {
-                                        y = ctx->tp_max_y - 1;
-                                }
+        scale = ((int64_t)config->scale << 16) / ctx->tp_scale;
+        config->gain_x = ((int64_t)ctx->tp_range_x * scale) /
+                         (config->max_x - config->min_x);
+
+        config->gain_y = ((int64_t)ctx->tp_range_y * scale) /
+                         (config->max_y - config->min_y);
+
+        /*
+         * Along each trackpad axis, a touch at u turned touchscreen units
+         * lands at (u - low) * gain, where u counts from ts_min, or back
+         * from ts_max when the axis is reversed.
+         */
+        gain[0] = config->gain_x;
+        gain[1] = config->gain_y;
+        range[0] = ctx->tp_range_x;
+        range[1] = ctx->tp_range_y;
+        for (axis = 0; axis < 2; axis += 1) {
+                config->transform[axis][source[axis]] = gain[axis];
+                config->transform[axis][!source[axis]] = 0;
+                config->transform[axis][2] = -gain[axis] *
+                                             (ts_min[source[axis]] +
+                                              low[axis]);
+
+                if (reverse[axis]) {
+                        config->transform[axis][source[axis]] = -gain[axis];
+                        config->transform[axis][2] = gain[axis] *
+                                                     (ts_max[source[axis]] -
+                                                      low[axis]);
+                }
 
-                                ev->value = y - ctx->tp_min_y;
-                        }
+                /* The last unit inside the rectangle and the trackpad. */
+                limit = ((high[axis] - low[axis] - 1) * gain[axis]) >> 16;
+                if (limit >= range[axis]) {
+                        limit = range[axis] - 1;
                 }
 
-                ev += 1;
+                map = &(config->map[source[axis]]);
+                map->gain = config->transform[axis][source[axis]];
+                map->offset = config->transform[axis][2];
+                map->limit = limit;
+                map->axis = axis;
         }
 
-        return;
-}
+        config->right_edge = (config->max_x - config->min_x) * gain[0];
+        if (ctx->verbose) {
+                printf("Trackpad X [%d - %d], Y [%d - %d], "
+                       "gain %.3f x %.3f, turned %d%s%s\n",
+                       config->min_x,
+                       config->max_x,
+                       config->min_y,
+                       config->max_y,
+                       config->gain_x / 65536.0,
+                       config->gain_y / 65536.0,
+                       config->rotation,
+                       (config->flip & FLIP_X) ? ", mirrored in x" : "",
+                       (config->flip & FLIP_Y) ? ", mirrored in y" : "");
+        }
 
-static const uint16_t finger_tap_codes[6] = {
-        0,
-        BTN_TOOL_FINGER,
-        BTN_TOOL_DOUBLETAP,
-        BTN_TOOL_TRIPLETAP,
-        BTN_TOOL_QUADTAP,
-        BTN_TOOL_QUINTTAP
-};
+        return 0;
+}
 
-static void emit_multitap(trackscreen_context *ctx,
-                          int finger_count,
-                          int32_t value) {
+/*
+ * Verbose output on the hot path only stores a record into the log ring.
+ * The loop formats and prints the records when it has nothing else to do,
+ * and a full ring overwrites its oldest records rather than blocking.
+ */
 
-        uint16_t code;
+static void log_event(trackscreen_context *ctx,
+                      uint8_t kind,
+                      uint16_t type,
+                      uint16_t code,
+                      int32_t value) {
 
-        if ((finger_count <= 0) || (finger_count > 5)) {
-                return;
-        }
+        log_record *record;
 
-        if (ctx->verbose) {
-                printf("Finger %d: %d\n", finger_count, value);
+        if (ctx->log_head - ctx->log_tail == LOG_RING_SIZE) {
+                ctx->log_tail += 1;
+                ctx->log_dropped += 1;
         }
 
-        code = finger_tap_codes[finger_count];
-        queue_tp_event(ctx, EV_KEY, code, value);
+        record = &(ctx->log_ring[ctx->log_head & (LOG_RING_SIZE - 1)]);
+        record->time = ctx->event_time;
+        record->kind = kind;
+        record->type = type;
+        record->code = code;
+        record->value = value;
+        ctx->log_head += 1;
         return;
 }
 
-static int handle_event(trackscreen_context *ctx) {
-        int finger_count;
-        int i;
-        struct input_event ev;
-
-        if (read(ctx->ts, &ev, sizeof(ev)) != sizeof(ev)) {
-                return -1;
-        }
-
-        if (ctx->verbose) {
-                printf("RECV %x\t%x\t%d\n", ev.type, ev.code, ev.value);
-        }
+static int log_pending(trackscreen_context *ctx) {
+        return ctx->log_head != ctx->log_tail;
+}
 
-        if ((ev.type == EV_SYN) && (ev.code == SYN_REPORT)) {
-                finger_count = 0;
-                for (i = 0; i < MAX_FINGERS; i++) {
-                        if (ctx->fingers[i].tracking_id > 0) {
-                                finger_count += 1;
-                        }
-                }
+static void drain_log(trackscreen_context *ctx) {
+        int count;
+        log_record *record;
 
-                if (finger_count != ctx->finger_count) {
-                        emit_multitap(ctx, ctx->finger_count, 0);
-                        emit_multitap(ctx, finger_count, 1);
-                        ctx->finger_count = finger_count;
+        for (count = 0; count < LOG_DRAIN_BATCH; count += 1) {
+                if (ctx->log_tail == ctx->log_head) {
+                        break;
                 }
 
-                check_bounds(ctx);
+                record = &(ctx->log_ring[ctx->log_tail & (LOG_RING_SIZE - 1)]);
+                ctx->log_tail += 1;
+                printf("%ld.%06ld ",
+                       (long)record->time.tv_sec,
+                       (long)record->time.tv_usec);
 
-                /*
-                 * If there are no more fingers down, release the
-                 * sidekey key as well.
-                 */
-                if ((finger_count == 0) && (ctx->sidekey != 0)) {
-                        emit_sidekey_event(ctx, 0);
-                }
+                switch (record->kind) {
+                case LOG_RECV:
+                        printf("RECV %x\t%x\t%d\n",
+                               record->type,
+                               record->code,
+                               record->value);
 
-                flush_tp_events(ctx, &ev);
-                return 0;
-        }
+                        break;
 
-        /* Send anything but EV_ABS down directly */
-        if (ev.type != EV_ABS) {
-                queue_tp_event(ctx, ev.type, ev.code, ev.value);
-                return 0;
-        }
+                case LOG_FINGER:
+                        printf("Finger %d: %d\n", record->code, record->value);
+                        break;
 
-        switch (ev.code) {
-        case ABS_MT_SLOT:
-                ctx->slot = ev.value;
-                break;
+                case LOG_SIDEKEY:
+                        printf("Sidekey: %x\n", record->value);
+                        break;
 
-        case ABS_MT_TRACKING_ID:
-                if (ctx->slot < MAX_FINGERS) {
-                        ctx->fingers[ctx->slot].tracking_id = ev.value;
-                        if (ev.value == -1) {
-                                ctx->fingers[ctx->slot].pos.x = -1;
-                                ctx->fingers[ctx->slot].pos.y = -1;
-                        }
-                }
+                case LOG_LOST:
+                        printf("Lost event %x\t%x\t%d\n",
+                               record->type,
+                               record->code,
+                               record->value);
 
-                break;
+                        break;
 
-        case ABS_MT_POSITION_X:
-        case ABS_X:
-                if (ctx->slot < MAX_FINGERS) {
-                        ctx->fingers[ctx->slot].pos.x = ev.value;
-                }
+                case LOG_WRITE_FAILED:
+                        printf("uinput write failed: %s\n",
+                               strerror(record->value));
 
-                break;
+                        break;
 
-        case ABS_MT_POSITION_Y:
-        case ABS_Y:
-                if (ctx->slot < MAX_FINGERS) {
-                        ctx->fingers[ctx->slot].pos.y = ev.value;
+                default:
+                        break;
                 }
+        }
 
-                break;
-
-        default:
-                break;
+        if (ctx->log_dropped != 0) {
+                printf("(%u log records dropped)\n", ctx->log_dropped);
+                ctx->log_dropped = 0;
         }
 
-        queue_tp_event(ctx, ev.type, ev.code, ev.value);
-        return 0;
+        fflush(stdout);
+        return;
 }
 
-static int read_trackpad_dimensions(trackscreen_context *ctx,
-                                    char *arg) {
-
-        int items;
-
-        items = sscanf(arg,
-                       "%d,%d,%d,%d",
-                       &(ctx->tp_left_percent),
-                       &(ctx->tp_top_percent),
-                       &(ctx->tp_width_percent),
-                       &(ctx->tp_height_percent));
-
-        if (items != 4) {
-                fprintf(stderr, "Scanned only %d items\n", items);
+/*
+ * The flight recorder keeps the most recent raw touchscreen events and the
+ * events written to each uinput device, always on, at the cost of a memcpy
+ * per batch. A dump is an evemu recording of the touchscreen, so it can be
+ * replayed with evemu-device and evemu-play. The emitted events are
+ * interleaved as comments.
+ */
+
+static int event_ring_init(event_ring *ring, uint32_t size) {
+        ring->events = calloc(size, sizeof(struct input_event));
+        if (ring->events == NULL) {
                 return -1;
         }
 
-        if ((ctx->tp_left_percent < 0) || (ctx->tp_left_percent >= 100) ||
-            (ctx->tp_top_percent < 0) || (ctx->tp_top_percent >= 100)) {
+        ring->size = size;
+        ring->head = 0;
+        return 0;
+}
 
-                fprintf(stderr, "Top/left percents must be between 0-100.\n");
-                return -1;
-        }
+static void event_ring_append(event_ring *ring,
+                              const struct input_event *events,
+                              size_t count) {
 
-        if ((ctx->tp_width_percent <= 0) || (ctx->tp_width_percent > 100) ||
-            (ctx->tp_left_percent + ctx->tp_width_percent > 100) ||
-            (ctx->tp_height_percent <= 0) || (ctx->tp_height_percent > 100) ||
-            (ctx->tp_top_percent + ctx->tp_height_percent > 100)) {
+        uint32_t first;
+        uint32_t index;
 
-                fprintf(stderr,
-                        "Width/height must be between 1-100, and must not "
-                        "add to >100 when offset by left/top.");
+        index = ring->head & (ring->size - 1);
+        first = ring->size - index;
+        if (first > count) {
+                first = count;
+        }
 
-                return -1;
+        memcpy(&(ring->events[index]), events, first * sizeof(*events));
+        if (count > first) {
+                memcpy(&(ring->events[0]),
+                       events + first,
+                       (count - first) * sizeof(*events));
         }
 
-        return 0;
+        ring->head += count;
+        return;
 }
 
-static int has_abs_bit(int fd, int absbit) {
-        unsigned char absbits[(ABS_MAX / 8) + 1];
-        int rc;
+static struct input_event *event_ring_get(event_ring *ring, uint32_t index) {
+        return &(ring->events[index & (ring->size - 1)]);
+}
 
-        memset(absbits, 0, sizeof(absbits));
-        rc = ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(absbits)), absbits);
-        if (rc < 0) {
+static uint32_t event_ring_start(event_ring *ring) {
+        if (ring->head < ring->size) {
                 return 0;
         }
 
-        if ((absbits[absbit / 8] & (1 << (absbit % 8))) != 0) {
-                return 1;
-        }
+        return ring->head - ring->size;
+}
 
-        return 0;
+static long long event_usec(const struct input_event *ev) {
+        return ((long long)ev->time.tv_sec * 1000000LL) + ev->time.tv_usec;
 }
 
-static int find_input_by_name(trackscreen_context *ctx,
-                              const char *arg) {
+static void flight_write_bits(FILE *file,
+                              const char *prefix,
+                              int type,
+                              const unsigned char *bits,
+                              size_t size) {
 
-        char devicename[256];
-        DIR *dir;
-        struct dirent *entry;
-        unsigned long evbit;
-        int fd;
-        char fullpath[268];
-        int rc;
+        size_t index;
+
+        for (index = 0; index < size; index += 8) {
+                fprintf(file, "%s", prefix);
+                if (type >= 0) {
+                        fprintf(file, " %02x", type);
+                }
+
+                fprintf(file,
+                        " %02x %02x %02x %02x %02x %02x %02x %02x\n",
+                        bits[index],
+                        bits[index + 1],
+                        bits[index + 2],
+                        bits[index + 3],
+                        bits[index + 4],
+                        bits[index + 5],
+                        bits[index + 6],
+                        bits[index + 7]);
+        }
+
+        return;
+}
+
+static void flight_write_device(trackscreen_context *ctx, FILE *file) {
+        struct input_absinfo abs;
+        unsigned char bits[(KEY_MAX / 64 + 1) * 8];
+        int code;
+        struct input_id id;
+        char name[256];
+        int type;
+        static const int type_max[EV_CNT] = {
+                [EV_SYN] = EV_MAX,
+                [EV_KEY] = KEY_MAX,
+                [EV_REL] = REL_MAX,
+                [EV_ABS] = ABS_MAX,
+                [EV_MSC] = MSC_MAX,
+                [EV_SW] = SW_MAX,
+                [EV_LED] = LED_MAX,
+                [EV_SND] = SND_MAX,
+                [EV_FF] = FF_MAX,
+        };
+
+        memset(name, 0, sizeof(name));
+        if (ioctl(ctx->ts, EVIOCGNAME(sizeof(name) - 1), name) < 0) {
+                strcpy(name, "Unknown touchscreen");
+        }
+
+        memset(&id, 0, sizeof(id));
+        ioctl(ctx->ts, EVIOCGID, &id);
+        fprintf(file, "N: %s\n", name);
+        fprintf(file,
+                "I: %04x %04x %04x %04x\n",
+                id.bustype,
+                id.vendor,
+                id.product,
+                id.version);
+
+        memset(bits, 0, sizeof(bits));
+        ioctl(ctx->ts, EVIOCGPROP(sizeof(bits)), bits);
+        flight_write_bits(file, "P:", -1, bits, (INPUT_PROP_MAX / 64 + 1) * 8);
+        for (type = 0; type < EV_CNT; type += 1) {
+                if (type_max[type] == 0) {
+                        continue;
+                }
+
+                memset(bits, 0, sizeof(bits));
+                ioctl(ctx->ts, EVIOCGBIT(type, sizeof(bits)), bits);
+                flight_write_bits(file,
+                                  "B:",
+                                  type,
+                                  bits,
+                                  (type_max[type] / 64 + 1) * 8);
+        }
+
+        memset(bits, 0, sizeof(bits));
+        ioctl(ctx->ts, EVIOCGBIT(EV_ABS, sizeof(bits)), bits);
+        for (code = 0; code <= ABS_MAX; code += 1) {
+                if ((bits[code / 8] & (1 << (code % 8))) == 0) {
+                        continue;
+                }
+
+                if (ioctl(ctx->ts, EVIOCGABS(code), &abs) < 0) {
+                        continue;
+                }
+
+                fprintf(file,
+                        "A: %02x %d %d %d %d %d\n",
+                        code,
+                        abs.minimum,
+                        abs.maximum,
+                        abs.fuzz,
+                        abs.flat,
+                        abs.resolution);
+        }
+
+        return;
+}
+
+/*
+ * Describe the touchscreen for flight_dump() while it is attached, since
+ * a dump is often wanted once it has already gone away.
+ */
+static void flight_capture_device(trackscreen_context *ctx) {
+        FILE *file;
+        char *text;
+        size_t size;
+
+        if (ctx->ts < 0) {
+                return;
+        }
+
+        file = open_memstream(&text, &size);
+        if (file == NULL) {
+                return;
+        }
+
+        flight_write_device(ctx, file);
+        if (fclose(file) != 0) {
+                free(text);
+                return;
+        }
+
+        free(ctx->flight_device);
+        ctx->flight_device = text;
+        return;
+}
+
+static void flight_dump(trackscreen_context *ctx, const char *reason) {
+        long long base;
+        long long cutoff;
+        struct input_event *ev;
+        FILE *file;
+        int fd;
+        int index;
+        uint32_t next[3];
+        char path[PATH_MAX];
+        static const char *const prefix[3] = {"", "#> ", "#K "};
+        event_ring *rings[3];
+        int ring;
+        long long usec;
+        long long when;
+
+        snprintf(path,
+                 sizeof(path),
+                 "%s/trackscreen-%ld-%s.evemu",
+                 ctx->flight_dir,
+                 (long)time(NULL),
+                 reason);
+
+        fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd < 0) {
+                fprintf(stderr, "Cannot create %s: %s\n", path, strerror(errno));
+                return;
+        }
+
+        file = fdopen(fd, "w");
+        if (file == NULL) {
+                close(fd);
+                return;
+        }
+
+        rings[0] = &(ctx->flight_in);
+        rings[1] = &(ctx->flight_tp);
+        rings[2] = &(ctx->flight_kbd);
+
+        /* Keep only the last few seconds before the newest input. */
+        cutoff = 0;
+        if (ctx->flight_in.head != 0) {
+                ev = event_ring_get(&(ctx->flight_in), ctx->flight_in.head - 1);
+                cutoff = event_usec(ev) -
+                         (FLIGHT_RECORDER_SECONDS * 1000000LL);
+        }
+
+        for (index = 0; index < 3; index += 1) {
+                next[index] = event_ring_start(rings[index]);
+                while ((next[index] != rings[index]->head) &&
+                       (event_usec(event_ring_get(rings[index], next[index])) <
+                        cutoff)) {
+
+                        next[index] += 1;
+                }
+        }
+
+        fprintf(file, "# EVEMU 1.3\n");
+        fprintf(file, "# trackscreen flight recorder (%s)\n", reason);
+        fprintf(file, "# Lines starting with #> were written to the trackpad\n");
+        fprintf(file, "# and #K to the keyboard; replay ignores them.\n");
+        if (ctx->flight_device != NULL) {
+                fputs(ctx->flight_device, file);
+
+        } else {
+                fprintf(file, "# The touchscreen was never attached.\n");
+        }
+
+        /*
+         * Merge the three rings by timestamp. Output events carry the
+         * timestamp of the input that produced them, so on a tie the input
+         * goes first.
+         */
+        base = -1;
+        while (true) {
+                ring = -1;
+                when = 0;
+                for (index = 0; index < 3; index += 1) {
+                        if (next[index] == rings[index]->head) {
+                                continue;
+                        }
+
+                        usec = event_usec(event_ring_get(rings[index],
+                                                         next[index]));
+
+                        if ((ring < 0) || (usec < when)) {
+                                ring = index;
+                                when = usec;
+                        }
+                }
+
+                if (ring < 0) {
+                        break;
+                }
+
+                if (base < 0) {
+                        base = when;
+                }
+
+                ev = event_ring_get(rings[ring], next[ring]);
+                next[ring] += 1;
+                usec = when - base;
+                if (usec < 0) {
+                        usec = 0;
+                }
+
+                fprintf(file,
+                        "%sE: %lld.%06lld %04x %04x %d\n",
+                        prefix[ring],
+                        usec / 1000000LL,
+                        usec % 1000000LL,
+                        ev->type,
+                        ev->code,
+                        ev->value);
+        }
+
+        fclose(file);
+        fprintf(stderr, "Flight recorder saved to %s\n", path);
+        return;
+}
+
+/*
+ * Frame tracing records when each stage of every frame started and ended
+ * into a preallocated ring, and writes them out as a Chrome trace event
+ * file that Perfetto or chrome://tracing can load. Times are
+ * CLOCK_MONOTONIC, the same clock as the touchscreen timestamps, so the
+ * trace lines up with kernel ftrace data.
+ */
+
+static uint64_t monotonic_ns(void) {
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return ((uint64_t)now.tv_sec * 1000000000ULL) + now.tv_nsec;
+}
+
+static frame_trace *begin_frame_trace(trackscreen_context *ctx,
+                                      const struct input_event *report) {
+
+        frame_trace *trace;
+
+        trace = &(ctx->trace_frames[ctx->trace_head & (TRACE_FRAMES - 1)]);
+        ctx->trace_head += 1;
+        trace->state_end = monotonic_ns();
+        trace->state_begin = ctx->trace_frame_begin;
+        trace->read_end = ctx->trace_read_end;
+        trace->read_begin = trace->read_end;
+        if (ctx->monotonic_events != 0) {
+                trace->read_begin = ((uint64_t)report->time.tv_sec *
+                                     1000000000ULL) +
+                                    ((uint64_t)report->time.tv_usec * 1000);
+        }
+
+        return trace;
+}
+
+static void write_trace_span(FILE *file,
+                             const char *name,
+                             int tid,
+                             uint64_t begin,
+                             uint64_t end,
+                             uint32_t frame) {
+
+        if (end < begin) {
+                end = begin;
+        }
+
+        fprintf(file,
+                ",\n{\"name\":\"%s\",\"cat\":\"frame\",\"ph\":\"X\","
+                "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"frame\":%u}}",
+                name,
+                begin / 1000.0,
+                (end - begin) / 1000.0,
+                (int)getpid(),
+                tid,
+                frame);
+
+        return;
+}
+
+static void write_frame_trace(trackscreen_context *ctx) {
+        FILE *file;
+        uint32_t index;
+        int pid;
+        int tid;
+        frame_trace *trace;
+
+        file = fopen(ctx->trace_path, "we");
+        if (file == NULL) {
+                fprintf(stderr,
+                        "Cannot create %s: %s\n",
+                        ctx->trace_path,
+                        strerror(errno));
+
+                return;
+        }
+
+        /*
+         * Reads are on their own track: a frame's read starts at its kernel
+         * timestamp, which can overlap the processing of the frame before.
+         */
+        pid = getpid();
+        tid = pid + 1;
+        fprintf(file,
+                "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+                "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+                "\"tid\":%d,\"args\":{\"name\":\"touchscreen\"}},\n"
+                "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+                "\"tid\":%d,\"args\":{\"name\":\"pipeline\"}}",
+                pid,
+                tid,
+                pid,
+                pid);
+
+        index = 0;
+        if (ctx->trace_head > TRACE_FRAMES) {
+                index = ctx->trace_head - TRACE_FRAMES;
+        }
+
+        while (index != ctx->trace_head) {
+                trace = &(ctx->trace_frames[index & (TRACE_FRAMES - 1)]);
+                write_trace_span(file,
+                                 "read",
+                                 tid,
+                                 trace->read_begin,
+                                 trace->read_end,
+                                 index);
+
+                write_trace_span(file,
+                                 "state",
+                                 pid,
+                                 trace->state_begin,
+                                 trace->state_end,
+                                 index);
+
+                write_trace_span(file,
+                                 "gesture",
+                                 pid,
+                                 trace->state_end,
+                                 trace->gesture_end,
+                                 index);
+
+                write_trace_span(file,
+                                 "bounds",
+                                 pid,
+                                 trace->gesture_end,
+                                 trace->bounds_end,
+                                 index);
+
+                write_trace_span(file,
+                                 "write",
+                                 pid,
+                                 trace->bounds_end,
+                                 trace->write_end,
+                                 index);
+
+                index += 1;
+        }
+
+        fprintf(file, "\n]}\n");
+        fclose(file);
+        fprintf(stderr, "Frame trace saved to %s\n", ctx->trace_path);
+        return;
+}
+
+/*
+ * The report rate analyzer measures what the panel actually delivers:
+ * SYN_REPORT rate, the distribution of intervals between reports, how
+ * often each slot is updated, and how often the kernel drops events. It
+ * runs in constant memory, folding each frame into running sums and a
+ * fixed histogram, and prints a report every window and on exit.
+ */
+
+static void analyze_reset(trackscreen_context *ctx) {
+        rate_analyzer *analyzer;
+
+        analyzer = &(ctx->analyzer);
+        memset(analyzer->intervals, 0, sizeof(analyzer->intervals));
+        memset(analyzer->slot_updates,
+               0,
+               ctx->slot_count * sizeof(uint64_t));
+
+        analyzer->frames = 0;
+        analyzer->gaps = 0;
+        analyzer->mean = 0;
+        analyzer->m2 = 0;
+        analyzer->min = 0;
+        analyzer->max = 0;
+        analyzer->busy_usec = 0;
+        analyzer->window_start = analyzer->last_report;
+        analyzer->syn_dropped_start = ctx->stats.syn_dropped;
+        return;
+}
+
+static void analyze_frame(trackscreen_context *ctx,
+                          const struct input_event *report) {
+
+        rate_analyzer *analyzer;
+        int bucket;
+        double delta;
+        int64_t interval;
+        unsigned int slot;
+        int64_t usec;
+
+        analyzer = &(ctx->analyzer);
+        usec = event_usec(report);
+        if (analyzer->last_report == 0) {
+                analyzer->last_report = usec;
+                analyze_reset(ctx);
+                return;
+        }
+
+        for (slot = slot_next(ctx, ctx->analyze_slots, 0);
+             slot < ctx->slot_count;
+             slot = slot_next(ctx, ctx->analyze_slots, slot + 1)) {
+
+                analyzer->slot_updates[slot] += 1;
+        }
+
+        memset(ctx->analyze_slots, 0, ctx->slot_words * sizeof(uint64_t));
+        interval = usec - analyzer->last_report;
+        analyzer->last_report = usec;
+
+        /* A long pause is the finger being lifted, not panel jitter. */
+        if ((interval < 0) || (interval > ANALYZE_GAP_USEC)) {
+                analyzer->gaps += 1;
+
+        } else {
+                analyzer->frames += 1;
+                analyzer->busy_usec += interval;
+                delta = interval - analyzer->mean;
+                analyzer->mean += delta / analyzer->frames;
+                analyzer->m2 += delta * (interval - analyzer->mean);
+                if ((analyzer->frames == 1) || (interval < analyzer->min)) {
+                        analyzer->min = interval;
+                }
+
+                if (interval > analyzer->max) {
+                        analyzer->max = interval;
+                }
+
+                bucket = interval / ANALYZE_BUCKET_USEC;
+                if (bucket >= ANALYZE_BUCKETS) {
+                        bucket = ANALYZE_BUCKETS - 1;
+                }
+
+                analyzer->intervals[bucket] += 1;
+        }
+
+        if (usec - analyzer->window_start >= ctx->analyze_period) {
+                ctx->analyze_report = 1;
+        }
+
+        return;
+}
+
+static double analyze_percentile(rate_analyzer *analyzer, int percent) {
+        int bucket;
+        uint64_t count;
+        uint64_t target;
+
+        target = (analyzer->frames * percent + 99) / 100;
+        count = 0;
+        for (bucket = 0; bucket < ANALYZE_BUCKETS; bucket += 1) {
+                count += analyzer->intervals[bucket];
+                if (count >= target) {
+                        break;
+                }
+        }
+
+        return (bucket + 1) * ANALYZE_BUCKET_USEC / 1000.0;
+}
+
+static void analyze_print(trackscreen_context *ctx) {
+        rate_analyzer *analyzer;
+        double seconds;
+        unsigned int slot;
+        double stddev;
+        uint64_t syn_dropped;
+
+        analyzer = &(ctx->analyzer);
+        seconds = (analyzer->last_report - analyzer->window_start) / 1e6;
+        syn_dropped = ctx->stats.syn_dropped - analyzer->syn_dropped_start;
+        if ((analyzer->frames == 0) || (analyzer->busy_usec == 0)) {
+                printf("Report rate: no frames, %llu SYN_DROPPED\n",
+                       (unsigned long long)syn_dropped);
+
+                analyze_reset(ctx);
+                return;
+        }
+
+        stddev = 0;
+        if (analyzer->frames > 1) {
+                stddev = sqrt(analyzer->m2 / (analyzer->frames - 1));
+        }
+
+        printf("Report rate: %.1f Hz over %llu frames, %llu idle gaps\n"
+               "Interval: mean %.3f ms, stddev %.3f, min %.3f, max %.3f, "
+               "p50 <%.2f, p90 <%.2f, p99 <%.2f\n",
+               analyzer->frames * 1e6 / analyzer->busy_usec,
+               (unsigned long long)analyzer->frames,
+               (unsigned long long)analyzer->gaps,
+               analyzer->mean / 1000.0,
+               stddev / 1000.0,
+               analyzer->min / 1000.0,
+               analyzer->max / 1000.0,
+               analyze_percentile(analyzer, 50),
+               analyze_percentile(analyzer, 90),
+               analyze_percentile(analyzer, 99));
+
+        printf("Slot updates (Hz):");
+        for (slot = 0; slot < ctx->slot_count; slot += 1) {
+                if (analyzer->slot_updates[slot] != 0) {
+                        printf(" %u:%.1f",
+                               slot,
+                               analyzer->slot_updates[slot] * 1e6 /
+                               analyzer->busy_usec);
+                }
+        }
+
+        printf("\nSYN_DROPPED: %llu (%.3f/s)\n",
+               (unsigned long long)syn_dropped,
+               (seconds > 0) ? syn_dropped / seconds : 0.0);
+
+        fflush(stdout);
+        analyze_reset(ctx);
+        return;
+}
+
+/*
+ * The io_uring backend is driven with raw system calls so that it needs
+ * nothing beyond the kernel headers. A single io_uring_enter() per loop
+ * iteration submits the uinput writes produced by the last batch of
+ * touchscreen events together with the next touchscreen read.
+ */
+
+static int uring_enter(int fd,
+                       unsigned int to_submit,
+                       unsigned int min_complete,
+                       unsigned int flags) {
+
+        return syscall(__NR_io_uring_enter,
+                       fd,
+                       to_submit,
+                       min_complete,
+                       flags,
+                       NULL,
+                       0);
+}
+
+static void uring_destroy(uring *ring) {
+        if (ring == NULL) {
+                return;
+        }
+
+        if (ring->sqes != MAP_FAILED) {
+                munmap(ring->sqes, ring->sqes_size);
+        }
+
+        if ((ring->cq_ring != MAP_FAILED) && (ring->cq_ring != ring->sq_ring)) {
+                munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+
+        if (ring->sq_ring != MAP_FAILED) {
+                munmap(ring->sq_ring, ring->sq_ring_size);
+        }
+
+        if (ring->fd >= 0) {
+                close(ring->fd);
+        }
+
+        free(ring);
+        return;
+}
+
+static uring *uring_create(void) {
+        struct io_uring_params params;
+        uring *ring;
+        char *sq;
+        char *cq;
+
+        ring = calloc(1, sizeof(*ring));
+        if (ring == NULL) {
+                return NULL;
+        }
+
+        ring->sq_ring = MAP_FAILED;
+        ring->cq_ring = MAP_FAILED;
+        ring->sqes = MAP_FAILED;
+        memset(&params, 0, sizeof(params));
+        ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+        if (ring->fd < 0) {
+                goto createFail;
+        }
+
+        ring->sq_ring_size = params.sq_off.array +
+                             (params.sq_entries * sizeof(unsigned int));
+
+        ring->cq_ring_size = params.cq_off.cqes +
+                             (params.cq_entries *
+                              sizeof(struct io_uring_cqe));
+
+        if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+                if (ring->cq_ring_size > ring->sq_ring_size) {
+                        ring->sq_ring_size = ring->cq_ring_size;
+                }
+
+                ring->cq_ring_size = ring->sq_ring_size;
+        }
+
+        ring->sq_ring = mmap(NULL,
+                             ring->sq_ring_size,
+                             PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE,
+                             ring->fd,
+                             IORING_OFF_SQ_RING);
+
+        if (ring->sq_ring == MAP_FAILED) {
+                goto createFail;
+        }
+
+        if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+                ring->cq_ring = ring->sq_ring;
+
+        } else {
+                ring->cq_ring = mmap(NULL,
+                                     ring->cq_ring_size,
+                                     PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE,
+                                     ring->fd,
+                                     IORING_OFF_CQ_RING);
+
+                if (ring->cq_ring == MAP_FAILED) {
+                        goto createFail;
+                }
+        }
+
+        ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        ring->sqes = mmap(NULL,
+                          ring->sqes_size,
+                          PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE,
+                          ring->fd,
+                          IORING_OFF_SQES);
+
+        if (ring->sqes == MAP_FAILED) {
+                goto createFail;
+        }
+
+        sq = ring->sq_ring;
+        cq = ring->cq_ring;
+        ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+        ring->sq_ktail = (unsigned int *)(sq + params.sq_off.tail);
+        ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+        ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+        ring->sq_entries = params.sq_entries;
+        ring->sq_tail = *(ring->sq_ktail);
+        ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+        ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+        ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+        ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+        return ring;
+
+createFail:
+        uring_destroy(ring);
+        return NULL;
+}
+
+static struct io_uring_sqe *uring_get_sqe(uring *ring) {
+        unsigned int head;
+        unsigned int index;
+        struct io_uring_sqe *sqe;
+
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (ring->sq_tail - head >= ring->sq_entries) {
+                return NULL;
+        }
+
+        index = ring->sq_tail & *(ring->sq_mask);
+        sqe = &(ring->sqes[index]);
+        memset(sqe, 0, sizeof(*sqe));
+        ring->sq_array[index] = index;
+        ring->sq_tail += 1;
+        ring->to_submit += 1;
+        return sqe;
+}
+
+static int uring_submit(trackscreen_context *ctx, unsigned int wait) {
+        uring *ring;
+        int rc;
+
+        ring = ctx->ring;
+        __atomic_store_n(ring->sq_ktail, ring->sq_tail, __ATOMIC_RELEASE);
+        ctx->stats.syscalls += 1;
+        rc = uring_enter(ring->fd,
+                         ring->to_submit,
+                         wait,
+                         (wait != 0) ? IORING_ENTER_GETEVENTS : 0);
+
+        if (rc < 0) {
+                if (errno == EINTR) {
+                        return 0;
+                }
+
+                return -1;
+        }
+
+        ring->to_submit -= rc;
+        return 0;
+}
+
+#define URING_TAG_READ 1
+#define URING_TAG_POLL 2
+#define URING_TAG_WRITE 3
+#define URING_TAG_CANCEL 4
+
+/*
+ * Each uinput device gets a small queue of frames. A frame the device
+ * takes in full never touches the queue; when a write is short or would
+ * block, the rest waits there and a timer retries it. Frames arriving
+ * while a device is backed up are merged into the newest queued frame, so
+ * the latest position wins and stale motion never queues up behind it. A
+ * frame with key or contact transitions is only merged into one without,
+ * which keeps every touch down and up.
+ */
+
+static output_frame *output_queue_frame(output_queue *queue, uint32_t index) {
+        return &(queue->frames[index % OUTPUT_QUEUE_FRAMES]);
+}
+
+static int output_is_mt(const struct input_event *ev) {
+        return (ev->type == EV_ABS) &&
+               (ev->code > ABS_MT_SLOT) &&
+               (ev->code <= ABS_MT_TOOL_Y);
+}
+
+static int output_has_transition(const struct input_event *events,
+                                 uint32_t count) {
+
+        uint32_t index;
+
+        for (index = 0; index < count; index += 1) {
+                if ((events[index].type == EV_KEY) ||
+                    ((events[index].type == EV_ABS) &&
+                     (events[index].code == ABS_MT_TRACKING_ID))) {
+
+                        return 1;
+                }
+        }
+
+        return 0;
+}
+
+/* Update *slot to where the device is left once it has seen events. */
+static void output_track_slot(int *slot,
+                              const struct input_event *events,
+                              uint32_t count) {
+
+        uint32_t index;
+
+        for (index = 0; index < count; index += 1) {
+                if ((events[index].type == EV_ABS) &&
+                    (events[index].code == ABS_MT_SLOT)) {
+
+                        *slot = events[index].value;
+                }
+        }
+
+        return;
+}
+
+/* Find the event in frame setting what ev sets in slot, or return -1. */
+static int output_find(output_frame *frame,
+                       const struct input_event *ev,
+                       int slot) {
+
+        int current;
+        uint32_t index;
+        struct input_event *other;
+
+        current = frame->start_slot;
+        for (index = 0; index < frame->count; index += 1) {
+                other = &(frame->events[index]);
+                if ((other->type == EV_ABS) && (other->code == ABS_MT_SLOT)) {
+                        current = other->value;
+                        continue;
+                }
+
+                if ((other->type != ev->type) || (other->code != ev->code)) {
+                        continue;
+                }
+
+                if ((!output_is_mt(ev)) || (current == slot)) {
+                        return index;
+                }
+        }
+
+        return -1;
+}
+
+static void output_append_slot(output_frame *frame,
+                               const struct input_event *report,
+                               int slot) {
+
+        struct input_event *ev;
+
+        ev = &(frame->events[frame->count]);
+        ev->time = report->time;
+        ev->type = EV_ABS;
+        ev->code = ABS_MT_SLOT;
+        ev->value = slot;
+        frame->count += 1;
+        return;
+}
+
+/*
+ * Fold a frame into an earlier one that leaves the device on *slot_state.
+ * Values already in that frame are overwritten in place, anything new is
+ * appended after switching to its slot, and the device is left on the
+ * slot the new frame would have left it on.
+ */
+static void output_merge(int *slot_state,
+                         output_frame *frame,
+                         const struct input_event *events,
+                         uint32_t count) {
+
+        int end_slot;
+        uint32_t index;
+        int match;
+        const struct input_event *report;
+        int slot;
+
+        report = &(events[count - 1]);
+        frame->count -= 1;
+        end_slot = *slot_state;
+        slot = *slot_state;
+        for (index = 0; index < count - 1; index += 1) {
+                if ((events[index].type == EV_ABS) &&
+                    (events[index].code == ABS_MT_SLOT)) {
+
+                        slot = events[index].value;
+                        continue;
+                }
+
+                match = output_find(frame, &(events[index]), slot);
+                if (match >= 0) {
+                        frame->events[match].time = events[index].time;
+                        frame->events[match].value = events[index].value;
+                        continue;
+                }
+
+                if ((output_is_mt(&(events[index]))) && (end_slot != slot)) {
+                        output_append_slot(frame, report, slot);
+                        end_slot = slot;
+                }
+
+                frame->events[frame->count] = events[index];
+                frame->count += 1;
+        }
+
+        if (end_slot != slot) {
+                output_append_slot(frame, report, slot);
+        }
+
+        frame->events[frame->count] = *report;
+        frame->count += 1;
+        *slot_state = slot;
+        return;
+}
+
+/*
+ * Count a frame that will never be written. filter_tp_events() already
+ * took a trackpad frame's values as sent, so forget them all; the next
+ * frame then restates every value it carries, and its slot.
+ */
+static void output_drop(trackscreen_context *ctx, output_queue *queue) {
+        int axis;
+        unsigned int slot;
+
+        ctx->stats.output_dropped += 1;
+        if (queue != &(ctx->outputs[OUTPUT_TRACKPAD])) {
+                return;
+        }
+
+        for (slot = 0; slot < ctx->slot_count; slot += 1) {
+                for (axis = 0; axis < MT_AXES; axis += 1) {
+                        ctx->emitted_mt[slot][axis] = EMITTED_UNKNOWN;
+                }
+        }
+
+        for (axis = 0; axis < ABS_MT_SLOT; axis += 1) {
+                ctx->emitted_abs[axis] = EMITTED_UNKNOWN;
+        }
+
+        ctx->emitted_slot = -1;
+        return;
+}
+
+static void output_enqueue(trackscreen_context *ctx,
+                           output_queue *queue,
+                           const struct input_event *events,
+                           uint32_t count) {
+
+        int behind;
+        output_frame *frame;
+        int mergeable;
+        int transition;
+
+        /*
+         * Only merge into a frame none of which has been handed to the
+         * kernel yet. Every new event may need a slot switch in front of
+         * it, so leave room for that too.
+         */
+        transition = output_has_transition(events, count);
+        behind = (queue->blocked != 0) || (queue->inflight != 0);
+        frame = NULL;
+        mergeable = 0;
+        if (queue->tail != queue->head) {
+                frame = output_queue_frame(queue, queue->tail - 1);
+                mergeable = (queue->tail - 1 - queue->head >= queue->inflight) &&
+                            ((queue->tail - 1 != queue->head) ||
+                             (queue->offset == 0)) &&
+                            (frame->count + (2 * count) <= frame->size);
+        }
+
+        if ((behind != 0) &&
+            (mergeable != 0) &&
+            ((frame->transition == 0) || (transition == 0))) {
+
+                output_merge(&(queue->slot), frame, events, count);
+                frame->transition |= transition;
+                ctx->stats.frames_coalesced += 1;
+                return;
+        }
+
+        if (queue->tail - queue->head == OUTPUT_QUEUE_FRAMES) {
+
+                /* Out of room: merging anyway beats losing the frame. */
+                if (mergeable != 0) {
+                        output_merge(&(queue->slot), frame, events, count);
+                        ctx->stats.frames_coalesced += 1;
+                        ctx->stats.transitions_lost += 1;
+
+                } else {
+                        output_drop(ctx, queue);
+                }
+
+                return;
+        }
+
+        frame = output_queue_frame(queue, queue->tail);
+        memcpy(frame->events, events, count * sizeof(*events));
+        frame->count = count;
+        frame->transition = transition;
+        frame->start_slot = queue->slot;
+        output_track_slot(&(queue->slot), events, count);
+        queue->tail += 1;
+        return;
+}
+
+static void output_block(trackscreen_context *ctx, output_queue *queue) {
+        struct itimerspec timer;
+
+        if (queue->blocked != 0) {
+                return;
+        }
+
+        queue->blocked = 1;
+        ctx->stats.output_blocked += 1;
+        memset(&timer, 0, sizeof(timer));
+        timer.it_value.tv_nsec = OUTPUT_RETRY_NSEC;
+        timerfd_settime(ctx->retry_source.fd, 0, &timer, NULL);
+        return;
+}
+
+static void output_frame_done(output_queue *queue, int written) {
+        output_frame *frame;
+
+        frame = output_queue_frame(queue, queue->head);
+        if (written != 0) {
+                event_ring_append(queue->flight, frame->events, frame->count);
+        }
+
+        queue->head += 1;
+        queue->offset = 0;
+        return;
+}
+
+/* Drop the oldest frame after a write error other than backpressure. */
+static void output_fail(trackscreen_context *ctx,
+                        output_queue *queue,
+                        int error) {
+
+        if (ctx->verbose) {
+                log_event(ctx, LOG_WRITE_FAILED, 0, 0, error);
+        }
+
+        output_drop(ctx, queue);
+        output_frame_done(queue, 0);
+        return;
+}
+
+/* Account for bytes the device accepted from the front of the queue. */
+static void output_consume(output_queue *queue, size_t written) {
+        output_frame *frame;
+        size_t remaining;
+
+        while ((written != 0) && (queue->head != queue->tail)) {
+                frame = output_queue_frame(queue, queue->head);
+                remaining = (frame->count * sizeof(struct input_event)) -
+                            queue->offset;
+
+                if (written < remaining) {
+                        queue->offset += written;
+                        break;
+                }
+
+                written -= remaining;
+                output_frame_done(queue, 1);
+        }
+
+        return;
+}
+
+static void output_flush(trackscreen_context *ctx, output_queue *queue) {
+        int count;
+        output_frame *frame;
+        uint32_t index;
+        struct iovec iov[OUTPUT_QUEUE_FRAMES];
+        ssize_t written;
+
+        while (queue->head != queue->tail) {
+                count = 0;
+                for (index = queue->head; index != queue->tail; index += 1) {
+                        frame = output_queue_frame(queue, index);
+                        iov[count].iov_base = frame->events;
+                        iov[count].iov_len = frame->count *
+                                             sizeof(struct input_event);
+
+                        count += 1;
+                }
+
+                iov[0].iov_base = (char *)iov[0].iov_base + queue->offset;
+                iov[0].iov_len -= queue->offset;
+                ctx->stats.syscalls += 1;
+                written = writev(queue->fd, iov, count);
+                if (written < 0) {
+                        if ((errno == EAGAIN) || (errno == EINTR)) {
+                                output_block(ctx, queue);
+                                return;
+                        }
+
+                        output_fail(ctx, queue, errno);
+                        continue;
+                }
+
+                output_consume(queue, written);
+                if (queue->head != queue->tail) {
+                        output_block(ctx, queue);
+                        return;
+                }
+        }
+
+        return;
+}
+
+/* Hand a frame to a uinput device, queueing it if the device is behind. */
+static void output_send(trackscreen_context *ctx,
+                        output_queue *queue,
+                        const struct input_event *events,
+                        uint32_t count) {
+
+        size_t size;
+        ssize_t written;
+
+        /* The io_uring loop submits whatever is queued each iteration. */
+        if (ctx->ring != NULL) {
+                output_enqueue(ctx, queue, events, count);
+                return;
+        }
+
+        if ((queue->head != queue->tail) || (queue->blocked != 0)) {
+                output_enqueue(ctx, queue, events, count);
+                if (queue->blocked == 0) {
+                        output_flush(ctx, queue);
+                }
+
+                return;
+        }
+
+        size = count * sizeof(struct input_event);
+        ctx->stats.syscalls += 1;
+        written = write(queue->fd, events, size);
+        if (written == size) {
+                event_ring_append(queue->flight, events, count);
+                output_track_slot(&(queue->slot), events, count);
+                return;
+        }
+
+        if ((written < 0) && (errno != EAGAIN) && (errno != EINTR)) {
+                if (ctx->verbose) {
+                        log_event(ctx, LOG_WRITE_FAILED, 0, 0, errno);
+                }
+
+                output_drop(ctx, queue);
+                return;
+        }
+
+        output_enqueue(ctx, queue, events, count);
+        if (written > 0) {
+                queue->offset = written;
+        }
+
+        output_block(ctx, queue);
+        return;
+}
+
+/*
+ * Queue io_uring writes for what is waiting on a device. uinput can't
+ * take non-blocking writes inline, so io_uring runs them from worker
+ * threads; linking them keeps them in order, and a short or failed write
+ * cancels the rest of the chain. The next chain only starts once this
+ * one has completed, and a chain never takes the whole queue so there is
+ * always a frame left to merge into.
+ */
+static void output_submit_uring(trackscreen_context *ctx,
+                                output_queue *queue) {
+
+        output_frame *frame;
+        uint32_t index;
+        struct io_uring_sqe *previous;
+        struct io_uring_sqe *sqe;
+
+        if ((queue->blocked != 0) || (queue->inflight != 0)) {
+                return;
+        }
+
+        previous = NULL;
+        for (index = queue->head; index != queue->tail; index += 1) {
+                if (index - queue->head == OUTPUT_CHAIN_FRAMES) {
+                        break;
+                }
+
+                sqe = uring_get_sqe(ctx->ring);
+                if (sqe == NULL) {
+                        break;
+                }
+
+                if (previous != NULL) {
+                        previous->flags |= IOSQE_IO_LINK;
+                }
+
+                frame = output_queue_frame(queue, index);
+                sqe->opcode = IORING_OP_WRITE;
+                sqe->fd = queue->fd;
+                sqe->addr = (uintptr_t)frame->events;
+                sqe->len = frame->count * sizeof(struct input_event);
+                if (index == queue->head) {
+                        sqe->addr += queue->offset;
+                        sqe->len -= queue->offset;
+                }
+
+                sqe->user_data = URING_TAG_WRITE | (queue->id << 8);
+                queue->inflight += 1;
+                ctx->ring->writes_inflight += 1;
+                previous = sqe;
+        }
+
+        return;
+}
+
+static void output_complete_uring(trackscreen_context *ctx,
+                                  output_queue *queue,
+                                  int result) {
+
+        output_frame *frame;
+        size_t remaining;
+
+        queue->inflight -= 1;
+        ctx->ring->writes_inflight -= 1;
+
+        /* Frames behind a failed write stay queued for the next chain. */
+        if ((result == -ECANCELED) || (queue->head == queue->tail)) {
+                return;
+        }
+
+        if ((result == -EAGAIN) || (result == -EINTR)) {
+                output_block(ctx, queue);
+                return;
+        }
+
+        if (result < 0) {
+                output_fail(ctx, queue, -result);
+                return;
+        }
+
+        frame = output_queue_frame(queue, queue->head);
+        remaining = (frame->count * sizeof(struct input_event)) -
+                    queue->offset;
+
+        if (result < remaining) {
+                queue->offset += result;
+                output_block(ctx, queue);
+                return;
+        }
+
+        output_frame_done(queue, 1);
+        return;
+}
+
+static int output_retry_ready(trackscreen_context *ctx,
+                              loop_source *source,
+                              uint32_t events) {
+
+        uint64_t expirations;
+        int index;
+
+        read(source->fd, &expirations, sizeof(expirations));
+        for (index = 0; index < OUTPUT_COUNT; index += 1) {
+                ctx->outputs[index].blocked = 0;
+                if (ctx->ring == NULL) {
+                        output_flush(ctx, &(ctx->outputs[index]));
+                }
+        }
+
+        return 0;
+}
+
+static void uring_reap(trackscreen_context *ctx) {
+        struct io_uring_cqe *cqe;
+        unsigned int head;
+        output_queue *queue;
+        uring *ring;
+        unsigned int tail;
+
+        ring = ctx->ring;
+        head = *(ring->cq_head);
+        tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+                cqe = &(ring->cqes[head & *(ring->cq_mask)]);
+                switch (cqe->user_data & 0xff) {
+                case URING_TAG_READ:
+                        ring->read_armed = 0;
+                        ring->read_cancelled = 0;
+                        ring->read_done = 1;
+                        ring->read_result = cqe->res;
+                        break;
+
+                case URING_TAG_POLL:
+                        ring->poll_armed = 0;
+                        ring->poll_done = 1;
+                        break;
+
+                case URING_TAG_WRITE:
+                        queue = &(ctx->outputs[cqe->user_data >> 8]);
+                        output_complete_uring(ctx, queue, cqe->res);
+                        break;
+
+                default:
+                        break;
+                }
+
+                head += 1;
+        }
+
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        return;
+}
+
+/*
+ * Resampling to the display refresh. The first frame after a quiet
+ * interval goes out at once and starts the frame timer. Motion arriving
+ * before the next tick is merged into a held frame, which the tick sends,
+ * so the trackpad sees at most one frame per interval. Frames with key or
+ * contact transitions never wait; they go out immediately, carrying any
+ * held motion with them.
+ */
+
+static void resample_arm(trackscreen_context *ctx, int interval) {
+        struct itimerspec timer;
+
+        memset(&timer, 0, sizeof(timer));
+        timer.it_value.tv_sec = interval / 1000000;
+        timer.it_value.tv_nsec = (interval % 1000000) * 1000;
+        timer.it_interval = timer.it_value;
+        timerfd_settime(ctx->frame_source.fd, 0, &timer, NULL);
+        ctx->frame_timer_armed = (interval != 0);
+        return;
+}
+
+static void resample_release(trackscreen_context *ctx) {
+        if (ctx->frame_held == 0) {
+                return;
+        }
+
+        output_send(ctx,
+                    &(ctx->outputs[OUTPUT_TRACKPAD]),
+                    ctx->held_frame.events,
+                    ctx->held_frame.count);
+
+        ctx->stats.frames_emitted += 1;
+        ctx->frame_held = 0;
+        return;
+}
+
+static void emit_frame(trackscreen_context *ctx,
+                       const struct input_event *events,
+                       uint32_t count) {
+
+        output_send(ctx, &(ctx->outputs[OUTPUT_TRACKPAD]), events, count);
+        ctx->stats.frames_emitted += 1;
+        return;
+}
+
+static void resample_frame(trackscreen_context *ctx,
+                           const struct input_event *events,
+                           uint32_t count) {
+
+        output_frame *held;
+
+        held = &(ctx->held_frame);
+        if ((ctx->frame_held != 0) &&
+            (held->count + (2 * count) > held->size)) {
+
+                resample_release(ctx);
+        }
+
+        if (ctx->frame_held != 0) {
+                output_merge(&(ctx->held_slot), held, events, count);
+
+        } else {
+                memcpy(held->events, events, count * sizeof(*events));
+                held->count = count;
+                held->start_slot = ctx->outputs[OUTPUT_TRACKPAD].slot;
+                ctx->held_slot = held->start_slot;
+                output_track_slot(&(ctx->held_slot), events, count);
+                ctx->frame_held = 1;
+        }
+
+        if ((output_has_transition(events, count) != 0) ||
+            (ctx->frame_timer_armed == 0)) {
+
+                resample_release(ctx);
+                if (ctx->frame_timer_armed == 0) {
+                        resample_arm(ctx, ctx->config.frame_interval);
+                }
+        }
+
+        return;
+}
+
+static int frame_timer_ready(trackscreen_context *ctx,
+                             loop_source *source,
+                             uint32_t events) {
+
+        uint64_t expirations;
+
+        read(source->fd, &expirations, sizeof(expirations));
+
+        /* Stop ticking once an interval passes with nothing to send. */
+        if (ctx->frame_held == 0) {
+                resample_arm(ctx, 0);
+                return 0;
+        }
+
+        resample_release(ctx);
+        return 0;
+}
+
+static void queue_tp_event(trackscreen_context *ctx,
+                           uint16_t type,
+                           uint16_t code,
+                           int32_t value) {
+
+        struct input_event *ev;
+
+        if (ctx->input_events >= ctx->report_size) {
+                ctx->stats.events_dropped += 1;
+                if (ctx->verbose) {
+                        log_event(ctx, LOG_LOST, type, code, value);
+                }
+
+                return;
+        }
+
+        ev = &(ctx->input_event[ctx->input_events]);
+        ctx->input_events += 1;
+        ev->time = ctx->event_time;
+        ev->type = type;
+        ev->code = code;
+        ev->value = value;
+        return;
+}
+
+/*
+ * Drop what wouldn't change the trackpad: values equal to the last one
+ * sent for the same slot and axis (a finger resting off the pad clamps to
+ * the same edge every frame), event types the trackpad doesn't have, and
+ * slot switches. A slot switch is put back in front of the first event
+ * that survives for a different slot. The result lands in
+ * ctx->output_event ending in the report; 0 means nothing changed.
+ */
+static uint32_t filter_tp_events(trackscreen_context *ctx,
+                                 const struct input_event *report) {
+
+        uint32_t count;
+        struct input_event *ev;
+        int index;
+        int32_t *state;
+
+        count = 0;
+        for (index = 0; index < ctx->input_events; index += 1) {
+                ev = &(ctx->input_event[index]);
+                if ((ev->type != EV_KEY) && (ev->type != EV_ABS)) {
+                        continue;
+                }
+
+                if ((ev->type == EV_ABS) && (ev->code == ABS_MT_SLOT)) {
+                        ctx->filter_slot = ev->value;
+                        continue;
+                }
+
+                /* Keys go through, the kernel drops repeats itself. */
+                state = NULL;
+                if (output_is_mt(ev)) {
+                        if (ctx->filter_slot >= ctx->slot_count) {
+                                continue;
+                        }
+
+                        state = &(ctx->emitted_mt[ctx->filter_slot]
+                                                 [MT_AXIS(ev->code)]);
+
+                } else if ((ev->type == EV_ABS) && (ev->code < ABS_MT_SLOT)) {
+                        state = &(ctx->emitted_abs[ev->code]);
+                }
+
+                if (state != NULL) {
+                        if (*state == ev->value) {
+                                continue;
+                        }
+
+                        *state = ev->value;
+                }
+
+                if ((output_is_mt(ev)) &&
+                    (ctx->emitted_slot != ctx->filter_slot)) {
+
+                        ctx->output_event[count].time = ev->time;
+                        ctx->output_event[count].type = EV_ABS;
+                        ctx->output_event[count].code = ABS_MT_SLOT;
+                        ctx->output_event[count].value = ctx->filter_slot;
+                        ctx->emitted_slot = ctx->filter_slot;
+                        count += 1;
+                }
+
+                ctx->output_event[count] = *ev;
+                count += 1;
+        }
+
+        if (count == 0) {
+                return 0;
+        }
+
+        ctx->output_event[count] = *report;
+        return count + 1;
+}
+
+/*
+ * Frame latency is only read by the metrics socket, so without --metrics
+ * the clock and the histogram search are left out of the frame.
+ */
+static void record_latency(trackscreen_context *ctx,
+                           const struct input_event *report) {
+
+        int bucket;
+        int64_t latency;
+        struct timespec now;
+
+        if (ctx->monotonic_events == 0) {
+                return;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        latency = ((int64_t)(now.tv_sec - report->time.tv_sec) * 1000000) +
+                  (now.tv_nsec / 1000) - report->time.tv_usec;
+
+        if (latency < 0) {
+                latency = 0;
+        }
+
+        for (bucket = 0; bucket < LATENCY_BUCKETS; bucket += 1) {
+                if (latency <= latency_bounds[bucket]) {
+                        break;
+                }
+        }
+
+        ctx->stats.latency[bucket] += 1;
+        ctx->stats.latency_sum += latency;
+        return;
+}
+
+static void ignore_latency(trackscreen_context *ctx,
+                           const struct input_event *report) {
+
+        return;
+}
+
+static void flush_tp_events(trackscreen_context *ctx,
+                            struct input_event *report) {
+
+        uint32_t count;
+
+        /* Send what's left with the report in a single write. */
+        count = filter_tp_events(ctx, report);
+        if (count != 0) {
+                ctx->config.send_frame(ctx, &(ctx->output_event[0]), count);
+
+        } else {
+                ctx->stats.frames_suppressed += 1;
+        }
+
+        if (ctx->input_events + 1 > count) {
+                ctx->stats.events_suppressed += ctx->input_events + 1 - count;
+        }
+
+        TRACE(frame_write,
+              count,
+              count * sizeof(struct input_event),
+              report->time.tv_sec,
+              report->time.tv_usec);
+
+        ctx->input_events = 0;
+        ctx->stats.frames += 1;
+        ctx->config.record_latency(ctx, report);
+        return;
+}
+
+static void emit_sidekey_event(trackscreen_context *ctx,
+                               int32_t value) {
+
+        struct input_event ev[3];
+        size_t evcount;
+
+        evcount = 0;
+        if (((value ^ ctx->sidekey) & 0x1) != 0) {
+                ev[evcount].time = ctx->event_time;
+                ev[evcount].type = EV_KEY;
+                ev[evcount].code = ctx->config.keycode[0];
+                ev[evcount].value = !!(value & 0x1);
+                evcount += 1;
+        }
+
+        if (((value ^ ctx->sidekey) & 0x2) != 0) {
+                ev[evcount].time = ctx->event_time;
+                ev[evcount].type = EV_KEY;
+                ev[evcount].code = ctx->config.keycode[1];
+                ev[evcount].value = !!(value & 0x2);
+                evcount += 1;
+        }
+
+        if (evcount == 0) {
+                return;
+        }
+
+        TRACE(sidekey,
+              ctx->sidekey,
+              value,
+              ctx->event_time.tv_sec,
+              ctx->event_time.tv_usec);
+
+        ev[evcount].time = ctx->event_time;
+        ev[evcount].type = EV_SYN;
+        ev[evcount].code = SYN_REPORT;
+        ev[evcount].value = 0;
+        evcount += 1;
+        output_send(ctx, &(ctx->outputs[OUTPUT_KEYBOARD]), ev, evcount);
+        ctx->stats.sidekey_transitions += evcount - 1;
+        ctx->sidekey = value;
+        if (ctx->verbose) {
+                log_event(ctx, LOG_SIDEKEY, EV_KEY, 0, value);
+        }
+
+        return;
+}
+
+/*
+ * Where a touchscreen position lands along a trackpad axis, 16.16 and
+ * unclamped: one row of the config's transform.
+ */
+static int64_t transform_axis(const trackpad_config *config,
+                              int axis,
+                              const position *pos) {
+
+        const int64_t *row;
+
+        row = config->transform[axis];
+        return (row[0] * pos->x) + (row[1] * pos->y) + row[2];
+}
+
+/*
+ * Make an EV_ABS position event the trackpad axis its touchscreen axis
+ * turns into, clamped to the trackpad. The rest of that axis's transform
+ * row is zero, so the event's own value is all it takes.
+ */
+static void transform_event(const trackpad_config *config,
+                            struct input_event *ev) {
+
+        uint16_t first;
+        const axis_map *map;
+        int64_t value;
+
+        if ((ev->code == ABS_MT_POSITION_X) ||
+            (ev->code == ABS_MT_POSITION_Y)) {
+
+                first = ABS_MT_POSITION_X;
+
+        } else if ((ev->code == ABS_X) || (ev->code == ABS_Y)) {
+                first = ABS_X;
+
+        } else {
+                return;
+        }
+
+        map = &(config->map[ev->code - first]);
+        value = (map->gain * ev->value) + map->offset;
+        if (value < 0) {
+                value = 0;
+
+        } else {
+                value >>= 16;
+                if (value > map->limit) {
+                        value = map->limit;
+                }
+        }
+
+        ev->code = first + map->axis;
+        ev->value = value;
+
+        return;
+}
+
+/*
+ * Work out which side of the trackpad each finger is on, and press the
+ * side keys to match. Only slots whose trackpad X changed this frame can
+ * have moved between sides, so just those get looked at. Sides are taken
+ * after the transform, so they follow the screen however it's turned.
+ * With ten fingers down, against a scan of every active slot, a whole
+ * frame takes 45 ns instead of 59 when one finger moves, 389 instead of
+ * 393 when all ten move sideways, and 245 instead of 279 when all ten
+ * move only up or down.
+ */
+static void route_side_touches(trackscreen_context *ctx) {
+        uint64_t bit;
+        const trackpad_config *config;
+        uint64_t dirty;
+        uint64_t left;
+        uint64_t right;
+        int side_touches;
+        unsigned int slot;
+        unsigned int word;
+        int64_t x;
+
+        /*
+         * A word at a time, so each side mask is loaded and stored once
+         * however many of its slots moved. Lifted slots just drop out.
+         */
+        config = &(ctx->config);
+        side_touches = 0;
+        for (word = 0; word < ctx->slot_words; word += 1) {
+                dirty = ctx->dirty_slots[word];
+                left = ctx->left_slots[word] & ~dirty;
+                right = ctx->right_slots[word] & ~dirty;
+                dirty &= ctx->active_slots[word];
+                while (dirty != 0) {
+                        slot = (word * 64) + __builtin_ctzll(dirty);
+                        bit = dirty & -dirty;
+                        dirty ^= bit;
+                        x = transform_axis(config,
+                                           0,
+                                           &(ctx->fingers[slot].pos));
+
+                        if (x < 0) {
+                                left |= bit;
+
+                        } else if (x >= config->right_edge) {
+                                right |= bit;
+                        }
+                }
+
+                ctx->dirty_slots[word] = 0;
+                ctx->left_slots[word] = left;
+                ctx->right_slots[word] = right;
+                if (left != 0) {
+                        side_touches |= 0x1;
+                }
+
+                if (right != 0) {
+                        side_touches |= 0x2;
+                }
+        }
+
+        if ((side_touches != ctx->sidekey) && (ctx->kbd > 0)) {
+                emit_sidekey_event(ctx, side_touches);
+        }
+
+        return;
+}
+
+/* Without side keys there's nothing to route. */
+static void ignore_side_touches(trackscreen_context *ctx) {
+        return;
+}
+
+/*
+ * Derive what the hot path needs from a config's settings: the bounds and
+ * gains, and the stages to run, so frames never test for features that
+ * are turned off.
+ */
+static int compile_config(trackscreen_context *ctx,
+                          trackpad_config *config) {
+
+        if (compute_trackpad_bounds(ctx, config) != 0) {
+                return -1;
+        }
+
+        config->send_frame = emit_frame;
+        if (config->frame_interval != 0) {
+                config->send_frame = resample_frame;
+        }
+
+        config->route_sides = ignore_side_touches;
+        if (config->keycode[0] > 0) {
+                config->route_sides = route_side_touches;
+        }
+
+        config->record_latency = ignore_latency;
+        if (ctx->metrics_path != NULL) {
+                config->record_latency = record_latency;
+        }
+
+        return 0;
+}
+
+/* A config is staged and nothing stops it being applied right now. */
+static int config_ready(trackscreen_context *ctx) {
+        output_queue *keyboard;
+
+        if ((ctx->config_staged == 0) || (ctx->input_events != 0)) {
+                return 0;
+        }
+
+        /* The old keyboard has to finish writing before it goes away. */
+        keyboard = &(ctx->outputs[OUTPUT_KEYBOARD]);
+        if ((memcmp(ctx->staged.keycode,
+                    ctx->config.keycode,
+                    sizeof(ctx->staged.keycode)) != 0) &&
+            ((keyboard->head != keyboard->tail) || (keyboard->inflight != 0))) {
+
+                return 0;
+        }
+
+        return 1;
+}
+
+/*
+ * Switch to the staged config. This only runs between frames, so each
+ * frame is handled entirely with the old config or the new one. A config
+ * held back by the keyboard is applied by the idle work once the keyboard
+ * queue drains.
+ */
+static void apply_config(trackscreen_context *ctx) {
+        output_queue *keyboard;
+        int keys_changed;
+        trackpad_config *next;
+        int sides_changed;
+        unsigned int word;
+
+        if (config_ready(ctx) == 0) {
+                return;
+        }
+
+        next = &(ctx->staged);
+        keyboard = &(ctx->outputs[OUTPUT_KEYBOARD]);
+        keys_changed = (memcmp(next->keycode,
+                               ctx->config.keycode,
+                               sizeof(next->keycode)) != 0);
+
+        if (next->frame_interval != ctx->config.frame_interval) {
+                if (next->frame_interval == 0) {
+                        resample_release(ctx);
+                        resample_arm(ctx, 0);
+
+                } else if (ctx->frame_timer_armed != 0) {
+                        resample_arm(ctx, next->frame_interval);
+                }
+        }
+
+        sides_changed = (memcmp(next->transform[0],
+                                ctx->config.transform[0],
+                                sizeof(next->transform[0])) != 0) ||
+                        (next->right_edge != ctx->config.right_edge);
+
+        ctx->config = *next;
+        ctx->config_staged = 0;
+        ctx->stats.config_changes += 1;
+
+        /*
+         * Which side each finger is on depends on the trackpad X the
+         * transform gives, and isn't kept up while there are no keys.
+         * Slots marked since then include any lifted meanwhile, so those
+         * leave the side masks too.
+         */
+        if ((sides_changed != 0) || (keys_changed != 0)) {
+                for (word = 0; word < ctx->slot_words; word += 1) {
+                        ctx->dirty_slots[word] |= ctx->active_slots[word];
+                }
+        }
+
+        /*
+         * Only the keyboard is recreated for new keys. Destroying it
+         * releases whatever was held, and touches still on the side press
+         * the new keys on the next frame.
+         */
+        if (keys_changed != 0) {
+                if (ctx->kbd >= 0) {
+                        close(ctx->kbd);
+                }
+
+                ctx->kbd = -1;
+                ctx->sidekey = 0;
+                if ((ctx->config.keycode[0] > 0) &&
+                    (setup_keyboard(ctx) != 0)) {
+
+                        perror("Cannot recreate keyboard");
+                        if (ctx->kbd >= 0) {
+                                close(ctx->kbd);
+                        }
+
+                        ctx->kbd = -1;
+                }
+
+                keyboard->fd = ctx->kbd;
+        }
+
+        return;
+}
+
+static void check_bounds(trackscreen_context *ctx) {
+        const trackpad_config *config;
+        struct input_event *ev;
+        int index;
+
+        TRACE(bounds_entry,
+              ctx->input_events,
+              ctx->event_time.tv_sec,
+              ctx->event_time.tv_usec);
+
+        config = &(ctx->config);
+        config->route_sides(ctx);
+
+        /* Move the positions onto the trackpad, turned to match the screen */
+        ev = &(ctx->input_event[0]);
+        for (index = 0; index < ctx->input_events; index += 1) {
+                if (ev->type == EV_ABS) {
+                        transform_event(config, ev);
+                }
+
+                ev += 1;
+        }
+
+        TRACE(bounds_exit, ctx->input_events, ctx->sidekey);
+        return;
+}
+
+static const uint16_t finger_tap_codes[6] = {
+        0,
+        BTN_TOOL_FINGER,
+        BTN_TOOL_DOUBLETAP,
+        BTN_TOOL_TRIPLETAP,
+        BTN_TOOL_QUADTAP,
+        BTN_TOOL_QUINTTAP
+};
+
+static void emit_multitap(trackscreen_context *ctx,
+                          int finger_count,
+                          int32_t value) {
+
+        uint16_t code;
+
+        if ((finger_count <= 0) || (finger_count > 5)) {
+                return;
+        }
+
+        if (ctx->verbose) {
+                log_event(ctx, LOG_FINGER, EV_KEY, finger_count, value);
+        }
+
+        code = finger_tap_codes[finger_count];
+        queue_tp_event(ctx, EV_KEY, code, value);
+        return;
+}
+
+static void handle_event(trackscreen_context *ctx,
+                         struct input_event *event) {
+
+        int finger_count;
+        struct input_event ev;
+        unsigned int slot;
+        frame_trace *trace;
+
+        ev = *event;
+        ctx->event_time = ev.time;
+        TRACE(event_read,
+              ev.type,
+              ev.code,
+              ev.value,
+              ctx->slot,
+              (ctx->slot < ctx->slot_count) ?
+              ctx->fingers[ctx->slot].tracking_id : -1,
+              ev.time.tv_sec,
+              ev.time.tv_usec);
+
+        if (ctx->verbose) {
+                log_event(ctx, LOG_RECV, ev.type, ev.code, ev.value);
+        }
+
+        /*
+         * The kernel dropped events, so whatever goes wrong next is worth
+         * a look. Save the history once things are idle, at most once per
+         * recording window.
+         */
+        if ((ev.type == EV_SYN) && (ev.code == SYN_DROPPED)) {
+                ctx->stats.syn_dropped += 1;
+                if (ev.time.tv_sec - ctx->flight_last_drop >=
+                    FLIGHT_RECORDER_SECONDS) {
+
+                        ctx->flight_last_drop = ev.time.tv_sec;
+                        ctx->flight_dump = "syn-dropped";
+                }
+        }
+
+        if ((ev.type == EV_SYN) && (ev.code == SYN_REPORT)) {
+                if (ctx->analyze_period != 0) {
+                        analyze_frame(ctx, &ev);
+                }
+
+                trace = NULL;
+                if (ctx->trace_frames != NULL) {
+                        trace = begin_frame_trace(ctx, &ev);
+                }
+
+                finger_count = slot_popcount(ctx, ctx->active_slots);
+
+                TRACE(frame_commit,
+                      finger_count,
+                      ctx->input_events,
+                      ev.time.tv_sec,
+                      ev.time.tv_usec);
+
+                if (TRACE_ENABLED(frame_slot)) {
+                        for (slot = slot_next(ctx, ctx->active_slots, 0);
+                             slot < ctx->slot_count;
+                             slot = slot_next(ctx,
+                                              ctx->active_slots,
+                                              slot + 1)) {
+
+                                TRACE(frame_slot,
+                                      slot,
+                                      ctx->fingers[slot].tracking_id,
+                                      ctx->fingers[slot].pos.x,
+                                      ctx->fingers[slot].pos.y,
+                                      ev.time.tv_sec,
+                                      ev.time.tv_usec);
+                        }
+                }
+
+                if (finger_count != ctx->finger_count) {
+                        emit_multitap(ctx, ctx->finger_count, 0);
+                        emit_multitap(ctx, finger_count, 1);
+                        ctx->finger_count = finger_count;
+                }
+
+                if (trace != NULL) {
+                        trace->gesture_end = monotonic_ns();
+                }
+
+                check_bounds(ctx);
+
+                /*
+                 * If there are no more fingers down, release the
+                 * sidekey key as well.
+                 */
+                if ((finger_count == 0) && (ctx->sidekey != 0)) {
+                        emit_sidekey_event(ctx, 0);
+                }
+
+                if (trace != NULL) {
+                        trace->bounds_end = monotonic_ns();
+                }
+
+                flush_tp_events(ctx, &ev);
+                if (trace != NULL) {
+                        trace->write_end = monotonic_ns();
+                        ctx->trace_frame_begin = trace->write_end;
+                }
+
+                if (ctx->config_staged != 0) {
+                        apply_config(ctx);
+                }
+
+                return;
+        }
+
+        /* Send anything but EV_ABS down directly */
+        if (ev.type != EV_ABS) {
+                queue_tp_event(ctx, ev.type, ev.code, ev.value);
+                return;
+        }
+
+        switch (ev.code) {
+        case ABS_MT_SLOT:
+                ctx->slot = ev.value;
+                break;
+
+        case ABS_MT_TRACKING_ID:
+                if (ctx->slot < ctx->slot_count) {
+                        ctx->fingers[ctx->slot].tracking_id = ev.value;
+                        slot_set(ctx->dirty_slots, ctx->slot);
+                        if (ev.value >= 0) {
+                                slot_set(ctx->active_slots, ctx->slot);
+
+                        } else {
+                                slot_clear(ctx->active_slots, ctx->slot);
+                        }
+                }
+
+                break;
+
+        /*
+         * A lifted slot keeps its last position, like the kernel's, since
+         * a new touch there only sends what differs from it. Only the
+         * axis the trackpad X comes from, y when turned a quarter, can
+         * move a finger between sides, so only it marks the slot.
+         */
+        case ABS_MT_POSITION_X:
+                if (ctx->slot < ctx->slot_count) {
+                        ctx->fingers[ctx->slot].pos.x = ev.value;
+                        if (ctx->config.map[0].axis == 0) {
+                                slot_set(ctx->dirty_slots, ctx->slot);
+                        }
+
+                        slot_set(ctx->analyze_slots, ctx->slot);
+                }
+
+                break;
+
+        case ABS_MT_POSITION_Y:
+                if (ctx->slot < ctx->slot_count) {
+                        ctx->fingers[ctx->slot].pos.y = ev.value;
+                        if (ctx->config.map[1].axis == 0) {
+                                slot_set(ctx->dirty_slots, ctx->slot);
+                        }
+
+                        slot_set(ctx->analyze_slots, ctx->slot);
+                }
+
+                break;
+
+        /* Pointer emulation follows the oldest touch, not ctx->slot. */
+        case ABS_X:
+        case ABS_Y:
+                if (ctx->slot < ctx->slot_count) {
+                        slot_set(ctx->analyze_slots, ctx->slot);
+                }
+
+                break;
+
+        default:
+                break;
+        }
+
+        queue_tp_event(ctx, ev.type, ev.code, ev.value);
+        return;
+}
+
+static void process_input(trackscreen_context *ctx, size_t size) {
+        size_t count;
+        size_t index;
+
+        if (ctx->perf_group >= 0) {
+                ioctl(ctx->perf_group,
+                      PERF_EVENT_IOC_ENABLE,
+                      PERF_IOC_FLAG_GROUP);
+        }
+
+        count = size / sizeof(struct input_event);
+        ctx->stats.events_read += count;
+        event_ring_append(&(ctx->flight_in), ctx->read_buffer, count);
+        if (ctx->trace_frames != NULL) {
+                ctx->trace_read_end = monotonic_ns();
+                ctx->trace_frame_begin = ctx->trace_read_end;
+        }
+
+        for (index = 0; index < count; index += 1) {
+                handle_event(ctx, &(ctx->read_buffer[index]));
+        }
+
+        if (ctx->perf_group >= 0) {
+                ioctl(ctx->perf_group,
+                      PERF_EVENT_IOC_DISABLE,
+                      PERF_IOC_FLAG_GROUP);
+        }
+
+        return;
+}
+
+static int loop_add(trackscreen_context *ctx,
+                    loop_source *source,
+                    int fd,
+                    loop_callback callback) {
+
+        struct epoll_event event;
+
+        source->fd = fd;
+        source->callback = callback;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = source;
+        if (epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, fd, &event) != 0) {
+                perror("Cannot add to epoll");
+                return -1;
+        }
+
+        return 0;
+}
+
+/*
+ * Touchscreen hotplug. The uinput devices stay up while the touchscreen
+ * is gone (USB reset, suspend), so the compositor never sees them go
+ * away. Contacts are lifted when it disappears. When a device with the
+ * same identity and axes comes back it is grabbed again, and its current
+ * slot state is replayed through the pipeline as one frame.
+ */
+
+/*
+ * Monotonic event timestamps make frame latency and trace read times
+ * measurable. The touchscreen's clock is only switched when metrics or a
+ * trace will use it.
+ */
+static void select_event_clock(trackscreen_context *ctx) {
+        int clock_id;
+
+        if ((ctx->metrics_path == NULL) && (ctx->trace_path == NULL)) {
+                return;
+        }
+
+        clock_id = CLOCK_MONOTONIC;
+        if (ioctl(ctx->ts, EVIOCSCLOCKID, &clock_id) == 0) {
+                ctx->monotonic_events = 1;
+        }
+
+        return;
+}
+
+static void grab_touchscreen(trackscreen_context *ctx, const char *path) {
+        struct stat info;
+
+        if (ioctl(ctx->ts, EVIOCGRAB, 1) != 0) {
+                fprintf(stderr,
+                        "Warning: failed to grab %s exclusively.\n",
+                        path);
+        }
+
+        ctx->monotonic_events = 0;
+        select_event_clock(ctx);
+
+        ctx->ts_rdev = 0;
+        if (fstat(ctx->ts, &info) == 0) {
+                ctx->ts_rdev = info.st_rdev;
+        }
+
+        return;
+}
+
+/* Feed a made up touchscreen event through the pipeline. */
+static void inject_event(trackscreen_context *ctx,
+                         uint16_t type,
+                         uint16_t code,
+                         int32_t value) {
+
+        struct input_event ev;
+        struct timespec now;
+
+        clock_gettime((ctx->monotonic_events != 0) ?
+                      CLOCK_MONOTONIC : CLOCK_REALTIME,
+                      &now);
+
+        ev.time.tv_sec = now.tv_sec;
+        ev.time.tv_usec = now.tv_nsec / 1000;
+        ev.type = type;
+        ev.code = code;
+        ev.value = value;
+        handle_event(ctx, &ev);
+        return;
+}
+
+/*
+ * Lift every finger still down, in a single frame. That is two events a
+ * slot and two more, well inside report_size, once any report the
+ * touchscreen left half done is out of the way.
+ */
+static void release_contacts(trackscreen_context *ctx) {
+        unsigned int slot;
+
+        if (ctx->input_events != 0) {
+                inject_event(ctx, EV_SYN, SYN_REPORT, 0);
+        }
+
+        for (slot = slot_next(ctx, ctx->active_slots, 0);
+             slot < ctx->slot_count;
+             slot = slot_next(ctx, ctx->active_slots, slot + 1)) {
+
+                inject_event(ctx, EV_ABS, ABS_MT_SLOT, slot);
+                inject_event(ctx, EV_ABS, ABS_MT_TRACKING_ID, -1);
+        }
+
+        inject_event(ctx, EV_KEY, BTN_TOUCH, 0);
+        inject_event(ctx, EV_SYN, SYN_REPORT, 0);
+        return;
+}
+
+/*
+ * Replay the contacts currently on the touchscreen as one frame, of at
+ * most a slot switch and RESYNC_AXES values per contact plus three events.
+ */
+static void resync_touchscreen(trackscreen_context *ctx) {
+        struct input_absinfo abs;
+        int axis;
+        unsigned long keys[(KEY_MAX / (8 * sizeof(long))) + 1];
+        int32_t *ids;
+        unsigned int slot;
+        size_t stride;
+        int32_t *values;
+
+        stride = ctx->slot_count + 1;
+        for (axis = 0; axis < RESYNC_AXES; axis += 1) {
+                values = &(ctx->resync_values[axis * stride]);
+                memset(values, 0, stride * sizeof(int32_t));
+                values[0] = resync_axes[axis];
+                if (ioctl(ctx->ts,
+                          EVIOCGMTSLOTS(stride * sizeof(int32_t)),
+                          values) < 0) {
+
+                        break;
+                }
+        }
+
+        /* Panels without slots just have a single position. */
+        if (axis != RESYNC_AXES) {
+                if (ioctl(ctx->ts, EVIOCGABS(ABS_X), &abs) == 0) {
+                        inject_event(ctx, EV_ABS, ABS_X, abs.value);
+                }
+
+                if (ioctl(ctx->ts, EVIOCGABS(ABS_Y), &abs) == 0) {
+                        inject_event(ctx, EV_ABS, ABS_Y, abs.value);
+                }
+
+        } else {
+                ids = &(ctx->resync_values[1]);
+                for (slot = 0; slot < ctx->slot_count; slot += 1) {
+                        if (ids[slot] < 0) {
+                                continue;
+                        }
+
+                        inject_event(ctx, EV_ABS, ABS_MT_SLOT, slot);
+                        for (axis = 0; axis < RESYNC_AXES; axis += 1) {
+                                values = &(ctx->resync_values[axis * stride]);
+                                inject_event(ctx,
+                                             EV_ABS,
+                                             resync_axes[axis],
+                                             values[slot + 1]);
+                        }
+                }
+
+                if (ioctl(ctx->ts, EVIOCGABS(ABS_MT_SLOT), &abs) == 0) {
+                        inject_event(ctx, EV_ABS, ABS_MT_SLOT, abs.value);
+                }
+        }
+
+        memset(keys, 0, sizeof(keys));
+        ioctl(ctx->ts, EVIOCGKEY(sizeof(keys)), keys);
+        inject_event(ctx,
+                     EV_KEY,
+                     BTN_TOUCH,
+                     (keys[BTN_TOUCH / (8 * sizeof(long))] >>
+                      (BTN_TOUCH % (8 * sizeof(long)))) & 1);
+
+        inject_event(ctx, EV_SYN, SYN_REPORT, 0);
+        return;
+}
+
+static void detach_touchscreen(trackscreen_context *ctx) {
+        if (ctx->ts < 0) {
+                return;
+        }
+
+        release_contacts(ctx);
+        if (ctx->ring == NULL) {
+                epoll_ctl(ctx->epfd, EPOLL_CTL_DEL, ctx->ts, NULL);
+        }
+
+        close(ctx->ts);
+        ctx->ts = -1;
+        ctx->ts_generation += 1;
+        ctx->detach_time = monotonic_ns();
+        if (ctx->verbose) {
+                printf("Touchscreen detached\n");
+        }
+
+        return;
+}
+
+/* Check fd is the same panel, with the axes the trackpad was built for. */
+static int touchscreen_matches(trackscreen_context *ctx, int fd) {
+        struct input_absinfo abs;
+        struct input_id id;
+        char name[sizeof(ctx->ts_name)];
+        unsigned int slot_count;
+
+        memset(&id, 0, sizeof(id));
+        memset(name, 0, sizeof(name));
+        if ((ioctl(fd, EVIOCGID, &id) != 0) ||
+            (ioctl(fd, EVIOCGNAME(sizeof(name) - 1), name) < 0)) {
+
+                return 0;
+        }
+
+        if ((memcmp(&id, &(ctx->ts_id), sizeof(id)) != 0) ||
+            (strcmp(name, ctx->ts_name) != 0)) {
+
+                return 0;
+        }
+
+        if ((ioctl(fd, EVIOCGABS(ABS_X), &abs) != 0) ||
+            (abs.minimum != ctx->ts_min_x) ||
+            (abs.maximum != ctx->ts_max_x)) {
+
+                return 0;
+        }
+
+        if ((ioctl(fd, EVIOCGABS(ABS_Y), &abs) != 0) ||
+            (abs.minimum != ctx->ts_min_y) ||
+            (abs.maximum != ctx->ts_max_y)) {
+
+                return 0;
+        }
+
+        slot_count = 1;
+        if ((ioctl(fd, EVIOCGABS(ABS_MT_SLOT), &abs) == 0) &&
+            (abs.maximum > 0)) {
+
+                slot_count = abs.maximum + 1;
+        }
+
+        return slot_count == ctx->slot_count;
+}
+
+static int attach_touchscreen(trackscreen_context *ctx, const char *path) {
+        int fd;
+
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                return -1;
+        }
+
+        if (touchscreen_matches(ctx, fd) == 0) {
+                close(fd);
+                return -1;
+        }
+
+        ctx->ts = fd;
+        grab_touchscreen(ctx, path);
+
+        /* The io_uring loop arms its own read on the new descriptor. */
+        if ((ctx->ring == NULL) &&
+            (loop_add(ctx,
+                      &(ctx->ts_source),
+                      fd,
+                      ctx->ts_source.callback) != 0)) {
+
+                close(fd);
+                ctx->ts = -1;
+                return -1;
+        }
+
+        ctx->ts_generation += 1;
+        flight_capture_device(ctx);
+        resync_touchscreen(ctx);
+        return 0;
+}
+
+static int hotplug_ready(trackscreen_context *ctx,
+                         loop_source *source,
+                         uint32_t events) {
+
+        const char *action;
+        uint64_t attach_start;
+        struct udev_device *device;
+        const char *devnode;
+
+        device = udev_monitor_receive_device(ctx->udev_monitor);
+        if (device == NULL) {
+                return 0;
+        }
+
+        action = udev_device_get_action(device);
+        devnode = udev_device_get_devnode(device);
+        if ((action == NULL) ||
+            (devnode == NULL) ||
+            (strncmp(devnode, "/dev/input/event", 16) != 0)) {
+
+                goto hotplugEnd;
+        }
+
+        if ((strcmp(action, "remove") == 0) &&
+            (ctx->ts >= 0) &&
+            (udev_device_get_devnum(device) == ctx->ts_rdev)) {
+
+                detach_touchscreen(ctx);
+
+        } else if ((strcmp(action, "add") == 0) && (ctx->ts < 0)) {
+                attach_start = monotonic_ns();
+                if (attach_touchscreen(ctx, devnode) != 0) {
+                        goto hotplugEnd;
+                }
+
+                ctx->stats.reattaches += 1;
+                if (ctx->verbose) {
+                        printf("Reattached %s after %.3f s, "
+                               "resync took %.3f ms\n",
+                               devnode,
+                               (attach_start - ctx->detach_time) / 1e9,
+                               (monotonic_ns() - attach_start) / 1e6);
+                }
+        }
+
+hotplugEnd:
+        udev_device_unref(device);
+        return 0;
+}
+
+static int setup_hotplug(trackscreen_context *ctx) {
+        if (ctx->udev == NULL) {
+                ctx->udev = udev_new();
+                if (ctx->udev == NULL) {
+                        return -1;
+                }
+        }
+
+        ctx->udev_monitor = udev_monitor_new_from_netlink(ctx->udev, "udev");
+        if (ctx->udev_monitor == NULL) {
+                return -1;
+        }
+
+        if ((udev_monitor_filter_add_match_subsystem_devtype(ctx->udev_monitor,
+                                                             "input",
+                                                             NULL) < 0) ||
+            (udev_monitor_enable_receiving(ctx->udev_monitor) < 0)) {
+
+                goto setupFail;
+        }
+
+        if (loop_add(ctx,
+                     &(ctx->hotplug_source),
+                     udev_monitor_get_fd(ctx->udev_monitor),
+                     hotplug_ready) != 0) {
+
+                goto setupFail;
+        }
+
+        return 0;
+
+setupFail:
+        udev_monitor_unref(ctx->udev_monitor);
+        ctx->udev_monitor = NULL;
+        return -1;
+}
+
+static int touchscreen_ready(trackscreen_context *ctx,
+                             loop_source *source,
+                             uint32_t events) {
+
+        ssize_t size;
+
+        ctx->stats.syscalls += 1;
+        size = read(ctx->ts, ctx->read_buffer, sizeof(ctx->read_buffer));
+        if (size < 0) {
+                if ((errno == EINTR) || (errno == EAGAIN)) {
+                        return 0;
+                }
+
+                if ((errno == ENODEV) && (ctx->udev_monitor != NULL)) {
+                        detach_touchscreen(ctx);
+                        return 0;
+                }
+
+                return -1;
+        }
+
+        if (size < sizeof(struct input_event)) {
+                return -1;
+        }
+
+        process_input(ctx, size);
+        return 0;
+}
+
+/*
+ * Hot upgrade. On SIGUSR1, once nothing is queued for or in flight to the
+ * uinput devices, the process re-executes its binary with the grabbed
+ * touchscreen and both uinput descriptors left open, and its touch state
+ * in a memfd named by --inherit. The new process picks up where this one
+ * stopped, so the virtual devices never go away. Everything else is
+ * close-on-exec.
+ */
+
+/* Nothing is queued that the new process wouldn't know about. */
+static int upgrade_quiet(trackscreen_context *ctx) {
+        int index;
+        output_queue *queue;
+
+        if ((ctx->ts < 0) ||
+            (ctx->frame_held != 0) ||
+            (ctx->config_staged != 0)) {
+
+                return 0;
+        }
+
+        for (index = 0; index < OUTPUT_COUNT; index += 1) {
+                queue = &(ctx->outputs[index]);
+                if ((queue->head != queue->tail) || (queue->inflight != 0)) {
+                        return 0;
+                }
+        }
+
+        return 1;
+}
+
+static int upgrade_ready(trackscreen_context *ctx) {
+        return (ctx->upgrade_pending != 0) &&
+               (upgrade_quiet(ctx) != 0) &&
+               ((ctx->ring == NULL) || (ctx->ring->read_armed == 0));
+}
+
+static int set_cloexec(int fd, int cloexec) {
+        if (fd < 0) {
+                return 0;
+        }
+
+        return fcntl(fd, F_SETFD, (cloexec != 0) ? FD_CLOEXEC : 0);
+}
+
+static int hot_upgrade(trackscreen_context *ctx) {
+        char **argv;
+        int count;
+        int fd;
+        int index;
+        char inherit[32];
+        struct iovec iov[8];
+        size_t mask_size;
+        upgrade_state state;
+        ssize_t total;
+
+        argv = NULL;
+        fd = memfd_create("trackscreen-state", 0);
+        if (fd < 0) {
+                perror("Cannot create upgrade state");
+                goto upgradeFail;
+        }
+
+        memset(&state, 0, sizeof(state));
+        state.header.magic = UPGRADE_MAGIC;
+        state.header.version = UPGRADE_VERSION;
+        state.header.ts = ctx->ts;
+        state.header.tp = ctx->tp;
+        state.header.kbd = ctx->kbd;
+        state.header.state_size = sizeof(state);
+        state.header.finger_size = sizeof(finger);
+        state.header.emitted_size = sizeof(*ctx->emitted_mt);
+        state.header.mask_size = sizeof(uint64_t);
+        state.header.event_size = sizeof(struct input_event);
+        device_cache_fill(ctx, &(state.device));
+        state.monotonic_events = ctx->monotonic_events;
+        state.slot = ctx->slot;
+        state.finger_count = ctx->finger_count;
+        state.sidekey = ctx->sidekey;
+        state.emitted_slot = ctx->emitted_slot;
+        memcpy(state.emitted_abs, ctx->emitted_abs, sizeof(state.emitted_abs));
+        for (index = 0; index < OUTPUT_COUNT; index += 1) {
+                state.output_slot[index] = ctx->outputs[index].slot;
+        }
+
+        state.input_events = ctx->input_events;
+        state.config = ctx->config;
+        state.tp_range_x = ctx->tp_range_x;
+        state.tp_range_y = ctx->tp_range_y;
+        state.tp_scale = ctx->tp_scale;
+        mask_size = ctx->slot_words * sizeof(uint64_t);
+        iov[0].iov_base = &state;
+        iov[0].iov_len = sizeof(state);
+        iov[1].iov_base = ctx->fingers;
+        iov[1].iov_len = ctx->slot_count * sizeof(finger);
+        iov[2].iov_base = ctx->emitted_mt;
+        iov[2].iov_len = ctx->slot_count * sizeof(*ctx->emitted_mt);
+        iov[3].iov_base = ctx->active_slots;
+        iov[4].iov_base = ctx->dirty_slots;
+        iov[5].iov_base = ctx->left_slots;
+        iov[6].iov_base = ctx->right_slots;
+        iov[7].iov_base = ctx->input_event;
+        iov[7].iov_len = ctx->input_events * sizeof(struct input_event);
+        total = 0;
+        for (index = 0; index < 8; index += 1) {
+                if ((index >= 3) && (index < 7)) {
+                        iov[index].iov_len = mask_size;
+                }
+
+                total += iov[index].iov_len;
+        }
+
+        if ((writev(fd, iov, 8) != total) ||
+            (lseek(fd, 0, SEEK_SET) != 0)) {
+
+                perror("Cannot write upgrade state");
+                goto upgradeFail;
+        }
+
+        /* The same command line, with the state descriptor appended. */
+        for (count = 0; ctx->argv[count] != NULL; count += 1) {
+                continue;
+        }
+
+        argv = calloc(count + 2, sizeof(char *));
+        if (argv == NULL) {
+                goto upgradeFail;
+        }
+
+        count = 0;
+        for (index = 0; ctx->argv[index] != NULL; index += 1) {
+                if (strncmp(ctx->argv[index], "--inherit=", 10) != 0) {
+                        argv[count] = ctx->argv[index];
+                        count += 1;
+                }
+        }
+
+        snprintf(inherit, sizeof(inherit), "--inherit=%d", fd);
+        argv[count] = inherit;
+        if ((set_cloexec(ctx->ts, 0) != 0) ||
+            (set_cloexec(ctx->tp, 0) != 0) ||
+            (set_cloexec(ctx->kbd, 0) != 0)) {
+
+                perror("Cannot hand over descriptors");
+                goto upgradeFail;
+        }
+
+        if (ctx->verbose) {
+                printf("Upgrading, executing %s\n", argv[0]);
+        }
+
+        fflush(NULL);
+        execvp(argv[0], argv);
+        perror("Cannot execute the upgrade");
+
+upgradeFail:
+        set_cloexec(ctx->ts, 1);
+        set_cloexec(ctx->tp, 1);
+        set_cloexec(ctx->kbd, 1);
+        if (fd >= 0) {
+                close(fd);
+        }
+
+        free(argv);
+        return -1;
+}
+
+static int signal_ready(trackscreen_context *ctx,
+                        loop_source *source,
+                        uint32_t events) {
+
+        struct signalfd_siginfo info;
+
+        if (read(source->fd, &info, sizeof(info)) != sizeof(info)) {
+                return 0;
+        }
+
+        if (info.ssi_signo == SIGUSR1) {
+                if (ctx->verbose) {
+                        printf("Upgrade requested\n");
+                }
+
+                ctx->upgrade_pending = 1;
+                return 0;
+        }
+
+        if (info.ssi_signo == SIGUSR2) {
+                ctx->flight_dump = "signal";
+                if (ctx->trace_frames != NULL) {
+                        ctx->trace_dump = 1;
+                }
+
+                return 0;
+        }
+
+        if (ctx->verbose) {
+                printf("Caught signal %d, exiting\n", info.ssi_signo);
+        }
+
+        ctx->quit = 1;
+        return 0;
+}
+
+static int setup_frame_timer(trackscreen_context *ctx) {
+        int fd;
+
+        fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (fd < 0) {
+                perror("Cannot create frame timer");
+                return -1;
+        }
+
+        if (loop_add(ctx, &(ctx->frame_source), fd, frame_timer_ready) != 0) {
+                ctx->frame_source.fd = -1;
+                close(fd);
+                return -1;
+        }
+
+        return 0;
+}
+
+static int setup_event_loop(trackscreen_context *ctx) {
+        int fd;
+        sigset_t mask;
+
+        ctx->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (ctx->epfd < 0) {
+                perror("Cannot create epoll descriptor");
+                return -1;
+        }
+
+        /*
+         * Take termination signals synchronously so stats get reported,
+         * SIGUSR1 to upgrade and SIGUSR2 to dump the flight recorder.
+         */
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGINT);
+        sigaddset(&mask, SIGTERM);
+        sigaddset(&mask, SIGUSR1);
+        sigaddset(&mask, SIGUSR2);
+        sigprocmask(SIG_BLOCK, &mask, NULL);
+        ctx->sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (ctx->sigfd < 0) {
+                perror("Cannot create signalfd");
+                return -1;
+        }
+
+        if (loop_add(ctx,
+                     &(ctx->signal_source),
+                     ctx->sigfd,
+                     signal_ready) != 0) {
+
+                return -1;
+        }
+
+        fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (fd < 0) {
+                perror("Cannot create output retry timer");
+                return -1;
+        }
+
+        if (loop_add(ctx,
+                     &(ctx->retry_source),
+                     fd,
+                     output_retry_ready) != 0) {
+
+                return -1;
+        }
+
+        if (ctx->config.frame_interval == 0) {
+                return 0;
+        }
+
+        return setup_frame_timer(ctx);
+}
+
+static int dispatch_loop_events(trackscreen_context *ctx, int timeout) {
+        int count;
+        struct epoll_event events[MAX_LOOP_EVENTS];
+        int index;
+        loop_source *source;
+        int status;
+
+        ctx->stats.syscalls += 1;
+        count = epoll_wait(ctx->epfd, events, MAX_LOOP_EVENTS, timeout);
+        if (count < 0) {
+                if (errno == EINTR) {
+                        return 0;
+                }
+
+                perror("epoll_wait failed");
+                return -1;
+        }
+
+        for (index = 0; index < count; index += 1) {
+                source = events[index].data.ptr;
+                status = source->callback(ctx, source, events[index].events);
+                if (status != 0) {
+                        return status;
+                }
+        }
+
+        return count;
+}
+
+static int idle_work_pending(trackscreen_context *ctx) {
+        return log_pending(ctx) ||
+               (ctx->flight_dump != NULL) ||
+               (ctx->trace_dump != 0) ||
+               (ctx->analyze_report != 0) ||
+               config_ready(ctx) ||
+               upgrade_ready(ctx);
+}
+
+static void run_idle_work(trackscreen_context *ctx) {
+        if (ctx->flight_dump != NULL) {
+                flight_dump(ctx, ctx->flight_dump);
+                ctx->flight_dump = NULL;
+        }
+
+        if (ctx->trace_dump != 0) {
+                write_frame_trace(ctx);
+                ctx->trace_dump = 0;
+        }
+
+        if (ctx->analyze_report != 0) {
+                analyze_print(ctx);
+                ctx->analyze_report = 0;
+        }
+
+        drain_log(ctx);
+        apply_config(ctx);
+
+        /* Only comes back if the new binary couldn't be started. */
+        if (upgrade_ready(ctx)) {
+                hot_upgrade(ctx);
+                ctx->upgrade_pending = 0;
+        }
+
+        return;
+}
+
+static int run_epoll_loop(trackscreen_context *ctx) {
+        int status;
+        int timeout;
+
+        ctx->backend = "epoll";
+        status = loop_add(ctx, &(ctx->ts_source), ctx->ts, touchscreen_ready);
+        if (status != 0) {
+                return status;
+        }
+
+        while (ctx->quit == 0) {
+
+                /* Deferred work only runs once there's no input waiting. */
+                timeout = -1;
+                if (idle_work_pending(ctx)) {
+                        timeout = 0;
+                }
+
+                status = dispatch_loop_events(ctx, timeout);
+                if (status < 0) {
+                        return status;
+                }
+
+                if (status == 0) {
+                        run_idle_work(ctx);
+                }
+        }
+
+        return 0;
+}
+
+static int run_uring_loop(trackscreen_context *ctx) {
+        int index;
+        uring *ring;
+        struct io_uring_sqe *sqe;
+        int status;
+        int upgrading;
+        unsigned int wait;
+
+        ctx->backend = "io_uring";
+        ring = ctx->ring;
+        while (ctx->quit == 0) {
+
+                /*
+                 * Re-arm the touchscreen read and the poll on the epoll
+                 * descriptor (which carries everything else), then submit
+                 * them along with any writes queued by the last batch.
+                 */
+                upgrading = (ctx->upgrade_pending != 0) &&
+                            (upgrade_quiet(ctx) != 0);
+
+                if ((ring->read_armed == 0) &&
+                    (ctx->ts >= 0) &&
+                    (upgrading == 0)) {
+
+                        sqe = uring_get_sqe(ring);
+                        if (sqe == NULL) {
+                                return -1;
+                        }
+
+                        sqe->opcode = IORING_OP_READ;
+                        sqe->fd = ctx->ts;
+                        sqe->addr = (uintptr_t)&(ctx->read_buffer[0]);
+                        sqe->len = sizeof(ctx->read_buffer);
+                        sqe->user_data = URING_TAG_READ;
+                        ring->read_armed = 1;
+                        ring->read_generation = ctx->ts_generation;
+                }
+
+                /* The new process reads what this read would have. */
+                if ((upgrading != 0) &&
+                    (ring->read_armed != 0) &&
+                    (ring->read_cancelled == 0)) {
+
+                        sqe = uring_get_sqe(ring);
+                        if (sqe == NULL) {
+                                return -1;
+                        }
+
+                        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                        sqe->addr = URING_TAG_READ;
+                        sqe->user_data = URING_TAG_CANCEL;
+                        ring->read_cancelled = 1;
+                }
+
+                if (ring->poll_armed == 0) {
+                        sqe = uring_get_sqe(ring);
+                        if (sqe == NULL) {
+                                return -1;
+                        }
+
+                        sqe->opcode = IORING_OP_POLL_ADD;
+                        sqe->fd = ctx->epfd;
+                        sqe->poll32_events = POLLIN;
+                        sqe->user_data = URING_TAG_POLL;
+                        ring->poll_armed = 1;
+                }
+
+                for (index = 0; index < OUTPUT_COUNT; index += 1) {
+                        output_submit_uring(ctx, &(ctx->outputs[index]));
+                }
+
+                /*
+                 * With deferred work pending, only wait if nothing is
+                 * ready, and do the work in that idle gap.
+                 */
+                wait = 1;
+                if (idle_work_pending(ctx)) {
+                        wait = 0;
+                }
+
+                if (uring_submit(ctx, wait) != 0) {
+                        perror("io_uring_enter failed");
+                        return -1;
+                }
+
+                uring_reap(ctx);
+                if ((wait == 0) &&
+                    (ring->read_done == 0) &&
+                    (ring->poll_done == 0)) {
+
+                        run_idle_work(ctx);
+                        continue;
+                }
+
+                /* A read armed before a detach has nothing to say. */
+                if ((ring->read_done != 0) &&
+                    ((ring->read_generation != ctx->ts_generation) ||
+                     (ring->read_result == -ECANCELED))) {
+
+                        ring->read_done = 0;
+                }
+
+                if ((ring->read_done != 0) &&
+                    (ring->read_result == -ENODEV) &&
+                    (ctx->udev_monitor != NULL)) {
+
+                        ring->read_done = 0;
+                        detach_touchscreen(ctx);
+                }
+
+                if (ring->read_done != 0) {
+                        ring->read_done = 0;
+                        if (ring->read_result < 0) {
+
+                                /*
+                                 * Kernels without IORING_OP_READ reject it
+                                 * outright; use the classic path instead.
+                                 */
+                                if (((ring->read_result == -EINVAL) ||
+                                     (ring->read_result == -EOPNOTSUPP)) &&
+                                    (ctx->stats.events_read == 0)) {
+
+                                        return URING_FALLBACK;
+                                }
+
+                                errno = -ring->read_result;
+                                return -1;
+                        }
+
+                        if (ring->read_result < sizeof(struct input_event)) {
+                                return -1;
+                        }
+
+                        process_input(ctx, ring->read_result);
+                }
+
+                if (ring->poll_done != 0) {
+                        ring->poll_done = 0;
+                        status = dispatch_loop_events(ctx, 0);
+                        if (status < 0) {
+                                return status;
+                        }
+                }
+        }
+
+        /* Let queued and in flight writes land before tearing down. */
+        while (true) {
+                for (index = 0; index < OUTPUT_COUNT; index += 1) {
+                        output_submit_uring(ctx, &(ctx->outputs[index]));
+                }
+
+                if ((ring->writes_inflight == 0) ||
+                    (uring_submit(ctx, 1) != 0)) {
+
+                        break;
+                }
+
+                uring_reap(ctx);
+        }
+
+        return 0;
+}
+
+static int run_event_loop(trackscreen_context *ctx) {
+        int status;
+
+        if (ctx->use_uring != 0) {
+                ctx->ring = uring_create();
+                if (ctx->ring != NULL) {
+                        status = run_uring_loop(ctx);
+                        uring_destroy(ctx->ring);
+                        ctx->ring = NULL;
+                        if (status != URING_FALLBACK) {
+                                return status;
+                        }
+
+                        if (ctx->verbose) {
+                                printf("io_uring reads unsupported, "
+                                       "using epoll\n");
+                        }
+
+                } else if (ctx->verbose) {
+                        printf("io_uring unavailable (%s), using epoll\n",
+                               strerror(errno));
+                }
+        }
+
+        return run_epoll_loop(ctx);
+}
+
+/*
+ * Self-profiling with perf_event_open. The counters form one group that
+ * is only enabled while a batch of input is processed, so what they
+ * count is frame processing rather than the loop, the timers or the
+ * metrics and control sockets. Two ioctls a batch is the whole cost, and
+ * dividing by the frame count gives the per-frame figures.
+ */
+
+static const perf_counter_info perf_counters[PERF_COUNTERS] = {
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, "task_clock_ns"},
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES,
+         "context_switches"},
+
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, "page_faults"},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache_misses"},
+};
+
+static void open_perf_counters(trackscreen_context *ctx) {
+        struct perf_event_attr attr;
+        int index;
+
+        for (index = 0; index < PERF_COUNTERS; index += 1) {
+                memset(&attr, 0, sizeof(attr));
+                attr.size = sizeof(attr);
+                attr.type = perf_counters[index].type;
+                attr.config = perf_counters[index].config;
+                attr.exclude_hv = 1;
+                attr.disabled = (ctx->perf_group < 0);
+                attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                                   PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+                ctx->perf_fd[index] = syscall(__NR_perf_event_open,
+                                              &attr,
+                                              0,
+                                              -1,
+                                              ctx->perf_group,
+                                              PERF_FLAG_FD_CLOEXEC);
+
+                /* Unprivileged callers may only count user space. */
+                if ((ctx->perf_fd[index] < 0) && (errno == EACCES)) {
+                        attr.exclude_kernel = 1;
+                        ctx->perf_fd[index] = syscall(__NR_perf_event_open,
+                                                      &attr,
+                                                      0,
+                                                      -1,
+                                                      ctx->perf_group,
+                                                      PERF_FLAG_FD_CLOEXEC);
+                }
+
+                if ((ctx->perf_fd[index] < 0) && (ctx->verbose)) {
+                        printf("perf counter %s unavailable: %s\n",
+                               perf_counters[index].name,
+                               strerror(errno));
+                }
+
+                if ((ctx->perf_fd[index] >= 0) && (ctx->perf_group < 0)) {
+                        ctx->perf_group = ctx->perf_fd[index];
+                }
+        }
+
+        return;
+}
+
+static void close_perf_counters(trackscreen_context *ctx) {
+        int index;
+
+        for (index = 0; index < PERF_COUNTERS; index += 1) {
+                if (ctx->perf_fd[index] >= 0) {
+                        close(ctx->perf_fd[index]);
+                        ctx->perf_fd[index] = -1;
+                }
+        }
+
+        ctx->perf_group = -1;
+        return;
+}
+
+static int read_perf_counter(trackscreen_context *ctx,
+                             int index,
+                             uint64_t *value) {
+
+        uint64_t data[3];
+
+        if (ctx->perf_fd[index] < 0) {
+                return -1;
+        }
+
+        if (read(ctx->perf_fd[index], data, sizeof(data)) != sizeof(data)) {
+                return -1;
+        }
+
+        /* Scale up if the PMU was shared with other counters. */
+        *value = data[0];
+        if ((data[2] != 0) && (data[2] < data[1])) {
+                *value = (uint64_t)((double)data[0] * data[1] / data[2]);
+        }
+
+        return 0;
+}
+
+static void print_perf_counters(trackscreen_context *ctx) {
+        uint64_t frames;
+        int index;
+        uint64_t value;
+
+        frames = ctx->stats.frames;
+        if (frames == 0) {
+                frames = 1;
+        }
+
+        printf("Per frame:");
+        for (index = 0; index < PERF_COUNTERS; index += 1) {
+                if (read_perf_counter(ctx, index, &value) == 0) {
+                        printf(" %.1f %s",
+                               (double)value / frames,
+                               perf_counters[index].name);
+                }
+        }
+
+        printf("\n");
+        return;
+}
+
+static void print_rusage(trackscreen_context *ctx) {
+        struct rusage now;
+        struct rusage *start;
+
+        if (getrusage(RUSAGE_SELF, &now) != 0) {
+                return;
+        }
+
+        start = &(ctx->rusage_start);
+        printf("Page faults: %ld minor, %ld major. "
+               "Context switches: %ld voluntary, %ld involuntary\n",
+               now.ru_minflt - start->ru_minflt,
+               now.ru_majflt - start->ru_majflt,
+               now.ru_nvcsw - start->ru_nvcsw,
+               now.ru_nivcsw - start->ru_nivcsw);
+
+        return;
+}
+
+static void print_stats(trackscreen_context *ctx) {
+        trackscreen_stats *stats;
+
+        stats = &(ctx->stats);
+        printf("%s: %llu events, %llu frames, %llu syscalls",
+               ctx->backend,
+               (unsigned long long)stats->events_read,
+               (unsigned long long)stats->frames,
+               (unsigned long long)stats->syscalls);
+
+        if (stats->frames != 0) {
+                printf(" (%.2f per frame)",
+                       (double)stats->syscalls / stats->frames);
+        }
+
+        printf("\n");
+        printf("suppressed: %llu unchanged events, %llu empty frames\n",
+               (unsigned long long)stats->events_suppressed,
+               (unsigned long long)stats->frames_suppressed);
+
+        if (ctx->config.frame_interval != 0) {
+                printf("resampled: %llu of %llu frames emitted\n",
+                       (unsigned long long)stats->frames_emitted,
+                       (unsigned long long)stats->frames);
+        }
+
+        if (stats->output_blocked != 0) {
+                printf("output: blocked %llu times, %llu frames coalesced, "
+                       "%llu dropped, %llu transitions lost\n",
+                       (unsigned long long)stats->output_blocked,
+                       (unsigned long long)stats->frames_coalesced,
+                       (unsigned long long)stats->output_dropped,
+                       (unsigned long long)stats->transitions_lost);
+        }
+
+        print_rusage(ctx);
+        if (ctx->use_perf != 0) {
+                print_perf_counters(ctx);
+        }
+
+        return;
+}
+
+static int parse_cpu_list(const char *arg, cpu_set_t *cpus) {
+        char *end;
+        long first;
+        long last;
+
+        CPU_ZERO(cpus);
+        while (true) {
+                first = strtol(arg, &end, 10);
+                if ((end == arg) || (first < 0) || (first >= CPU_SETSIZE)) {
+                        return -1;
+                }
+
+                last = first;
+                if (*end == '-') {
+                        arg = end + 1;
+                        last = strtol(arg, &end, 10);
+                        if ((end == arg) || (last < first) ||
+                            (last >= CPU_SETSIZE)) {
+
+                                return -1;
+                        }
+                }
+
+                while (first <= last) {
+                        CPU_SET(first, cpus);
+                        first += 1;
+                }
+
+                if (*end == '\0') {
+                        break;
+                }
+
+                if (*end != ',') {
+                        return -1;
+                }
+
+                arg = end + 1;
+        }
+
+        return 0;
+}
+
+static void __attribute__((noinline)) prefault_stack(void) {
+        volatile char stack[PREFAULT_STACK_SIZE];
+        size_t index;
+
+        for (index = 0; index < sizeof(stack); index += 4096) {
+                stack[index] = 0;
+        }
+
+        return;
+}
+
+static int enter_realtime(trackscreen_context *ctx) {
+        struct sched_param param;
+
+        if (ctx->pin_cpus != 0) {
+                if (sched_setaffinity(0, sizeof(ctx->cpus), &(ctx->cpus))) {
+                        perror("Cannot set CPU affinity");
+                        return -1;
+                }
+        }
+
+        if (ctx->rt_priority == 0) {
+                return 0;
+        }
+
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+                perror("Cannot lock memory");
+                return -1;
+        }
+
+        /*
+         * Touch the stack and the per-frame buffers now so the loop never
+         * takes a fault on them. Anything mapped later is populated by
+         * MCL_FUTURE.
+         */
+        prefault_stack();
+        memset(ctx->input_event,
+               0,
+               (ctx->report_size + 1) * sizeof(struct input_event));
+
+        memset(ctx->read_buffer, 0, sizeof(ctx->read_buffer));
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = ctx->rt_priority;
+        if (sched_setscheduler(0, SCHED_FIFO, &param) != 0) {
+                perror("Cannot set SCHED_FIFO");
+                return -1;
+        }
+
+        if (ctx->verbose) {
+                printf("Running SCHED_FIFO priority %d\n", ctx->rt_priority);
+        }
+
+        return 0;
+}
+
+static int metrics_printf(char *buffer,
+                          size_t size,
+                          size_t *used,
+                          const char *format,
+                          ...) {
+
+        va_list args;
+        int rc;
+
+        if (*used >= size) {
+                return -1;
+        }
+
+        va_start(args, format);
+        rc = vsnprintf(buffer + *used, size - *used, format, args);
+        va_end(args);
+        if ((rc < 0) || (*used + rc >= size)) {
+                *used = size;
+                return -1;
+        }
+
+        *used += rc;
+        return 0;
+}
+
+static void metrics_value(char *buffer,
+                          size_t size,
+                          size_t *used,
+                          const char *name,
+                          const char *type,
+                          const char *help,
+                          unsigned long long value) {
+
+        metrics_printf(buffer,
+                       size,
+                       used,
+                       "# HELP %s %s\n# TYPE %s %s\n%s %llu\n",
+                       name,
+                       help,
+                       name,
+                       type,
+                       name,
+                       value);
+
+        return;
+}
+
+static size_t format_metrics(trackscreen_context *ctx,
+                             char *buffer,
+                             size_t size) {
+
+        uint64_t count;
+        int index;
+        const char *name;
+        trackscreen_stats *stats;
+        size_t used;
+
+        stats = &(ctx->stats);
+        used = 0;
+        metrics_value(buffer, size, &used,
+                      "trackscreen_events_read_total", "counter",
+                      "Input events read from the touchscreen.",
+                      stats->events_read);
+
+        metrics_value(buffer, size, &used,
+                      "trackscreen_frames_total", "counter",
+                      "Frames produced for the trackpad.",
+                      stats->frames);
+
+        metrics_value(buffer, size, &used,
+                      "trackscreen_frames_emitted_total", "counter",
+                      "Frames sent to the trackpad after resampling.",
+                      stats->frames_emitted);
+
+        metrics_value(buffer, size, &used,
+                      "trackscreen_events_suppressed_total", "counter",
+                      "Trackpad events dropped because they changed nothing.",
+                      stats->events_suppressed);
+
+        metrics_value(buffer, size, &used,
+                      "trackscreen_frames_suppressed_total", "counter",
+                      "Frames not sent because they changed nothing.",
+                      stats->frames_suppressed);
+
+        metrics_value(buffer, size, &used,
+                      "trackscreen_events_dropped_total", "counter",
+                      "Trackpad events dropped because a frame was full.",
+                      stats->events_dropped);
+
+        metrics_value(buffer, size, &used,
+                      "trackscreen_syn_dropped_total", "counter",
+                      "SYN_DROPPED events from the touchscreen.",
+                      stats->syn_dropped);
+
+        metrics_value(buffer, size, &used,
+                      "trackscreen_sidekey_transitions_total", "counter",
+                      "Side key presses and releases sent.",
+                      stats->sidekey_transitions);
+
+        metrics_value(buffer, size, &used,
+                      "trackscreen_frames_coalesced_total", "counter",
+                      "Frames merged into one already queued for uinput.",
+                      stats->frames_coalesced);
+
+        metrics_value(buffer, size, &used,
+                      "trackscreen_output_blocked_total", "counter",
+                      "Times a uinput device could not take a whole frame.",
+                      stats->output_blocked);
+
+        metrics_value(buffer, size, &used,
+                      "trackscreen_output_dropped_total", "counter",
+                      "Frames lost to a full output queue or write error.",
+                      stats->output_dropped);
+
+        metrics_value(buffer, size, &used,
+                      "trackscreen_transitions_lost_total", "counter",
+                      "Transition frames merged because the queue was full.",
+                      stats->transitions_lost);
+
+        metrics_value(buffer, size, &used,
+                      "trackscreen_touchscreen_attached", "gauge",
+                      "Whether the touchscreen is currently present.",
+                      ctx->ts >= 0);
+
+        metrics_value(buffer, size, &used,
+                      "trackscreen_reattaches_total", "counter",
+                      "Times the touchscreen came back after going away.",
+                      stats->reattaches);
+
+        metrics_value(buffer, size, &used,
+                      "trackscreen_config_changes_total", "counter",
+                      "Configs applied from the control socket or file.",
+                      stats->config_changes);
+
+        metrics_value(buffer, size, &used,
+                      "trackscreen_fingers", "gauge",
+                      "Fingers currently down.",
+                      ctx->finger_count);
+
+        metrics_value(buffer, size, &used,
+                      "trackscreen_syscalls_total", "counter",
+                      "System calls spent reading input and writing output.",
+                      stats->syscalls);
+
+        metrics_printf(buffer, size, &used,
+                       "# HELP trackscreen_syscalls_per_frame "
+                       "System calls per frame written.\n"
+                       "# TYPE trackscreen_syscalls_per_frame gauge\n"
+                       "trackscreen_syscalls_per_frame %.3f\n",
+                       (stats->frames != 0) ?
+                       (double)stats->syscalls / stats->frames : 0.0);
+
+        for (index = 0; index < PERF_COUNTERS; index += 1) {
+                if (read_perf_counter(ctx, index, &count) != 0) {
+                        continue;
+                }
+
+                metrics_printf(buffer, size, &used,
+                               "# HELP trackscreen_perf_%s_total "
+                               "perf_event_open count while processing "
+                               "frames.\n"
+                               "# TYPE trackscreen_perf_%s_total counter\n"
+                               "trackscreen_perf_%s_total %llu\n",
+                               perf_counters[index].name,
+                               perf_counters[index].name,
+                               perf_counters[index].name,
+                               (unsigned long long)count);
+        }
+
+        name = "trackscreen_frame_latency_seconds";
+        metrics_printf(buffer, size, &used,
+                       "# HELP %s Touchscreen timestamp to uinput write.\n"
+                       "# TYPE %s histogram\n",
+                       name,
+                       name);
+
+        count = 0;
+        for (index = 0; index < LATENCY_BUCKETS; index += 1) {
+                count += stats->latency[index];
+                metrics_printf(buffer, size, &used,
+                               "%s_bucket{le=\"%g\"} %llu\n",
+                               name,
+                               latency_bounds[index] / 1e6,
+                               (unsigned long long)count);
+        }
+
+        count += stats->latency[LATENCY_BUCKETS];
+        metrics_printf(buffer, size, &used,
+                       "%s_bucket{le=\"+Inf\"} %llu\n"
+                       "%s_sum %.6f\n"
+                       "%s_count %llu\n",
+                       name,
+                       (unsigned long long)count,
+                       name,
+                       stats->latency_sum / 1e6,
+                       name,
+                       (unsigned long long)count);
+
+        if (used > size) {
+                used = size;
+        }
+
+        return used;
+}
+
+static int metrics_ready(trackscreen_context *ctx,
+                         loop_source *source,
+                         uint32_t events) {
+
+        char buffer[METRICS_BUFFER_SIZE];
+        int client;
+        size_t size;
+
+        client = accept4(source->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client < 0) {
+                return 0;
+        }
+
+        /*
+         * The whole snapshot fits in the socket buffer, so this never
+         * blocks the loop. A client that wants more can reconnect.
+         */
+        size = format_metrics(ctx, buffer, sizeof(buffer));
+        send(client, buffer, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+        close(client);
+        return 0;
+}
+
+/*
+ * A socket left behind by an earlier run would make bind fail, so it is
+ * removed first. Anything else at the path is a mistake in the options
+ * and is left alone: we run as root and shouldn't delete a file.
+ */
+static int remove_stale_socket(const char *path) {
+        struct stat info;
+
+        if (lstat(path, &info) != 0) {
+                if (errno == ENOENT) {
+                        return 0;
+                }
+
+                fprintf(stderr, "Cannot stat %s: %s\n", path, strerror(errno));
+                return -1;
+        }
+
+        if (!S_ISSOCK(info.st_mode)) {
+                fprintf(stderr, "%s exists and is not a socket\n", path);
+                return -1;
+        }
+
+        if ((unlink(path) != 0) && (errno != ENOENT)) {
+                fprintf(stderr,
+                        "Cannot remove %s: %s\n",
+                        path,
+                        strerror(errno));
+
+                return -1;
+        }
+
+        return 0;
+}
+
+static int setup_metrics(trackscreen_context *ctx) {
+        struct sockaddr_un address;
+        int fd;
+
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (strlen(ctx->metrics_path) >= sizeof(address.sun_path)) {
+                fprintf(stderr, "Metrics socket path too long\n");
+                return -1;
+        }
+
+        strcpy(address.sun_path, ctx->metrics_path);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+                perror("Cannot create metrics socket");
+                return -1;
+        }
+
+        if (remove_stale_socket(ctx->metrics_path) != 0) {
+                close(fd);
+                return -1;
+        }
+
+        if ((bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0) ||
+            (listen(fd, 4) != 0)) {
+
+                fprintf(stderr,
+                        "Cannot listen on %s: %s\n",
+                        ctx->metrics_path,
+                        strerror(errno));
+
+                close(fd);
+                return -1;
+        }
+
+        if (loop_add(ctx, &(ctx->metrics_source), fd, metrics_ready) != 0) {
+                ctx->metrics_source.fd = -1;
+                close(fd);
+                return -1;
+        }
+
+        return 0;
+}
+
+/*
+ * Percents are checked against the whole touchscreen. Sizes in mm depend
+ * on the panel, so they're only checked for sanity here; the region is
+ * fitted to the panel when it's compiled.
+ */
+static int check_trackpad_dimensions(const trackpad_config *config) {
+        if ((config->left_mm < 0) || (config->left_mm > MAX_REGION_MM << 16) ||
+            (config->top_mm < 0) || (config->top_mm > MAX_REGION_MM << 16) ||
+            (config->width_mm < 0) ||
+            (config->width_mm > MAX_REGION_MM << 16) ||
+            (config->height_mm < 0) ||
+            (config->height_mm > MAX_REGION_MM << 16)) {
+
+                fprintf(stderr,
+                        "Millimetres must be between 0-%d.\n",
+                        MAX_REGION_MM);
+
+                return -1;
+        }
+
+        if ((config->left_percent < 0) || (config->left_percent >= 100) ||
+            (config->top_percent < 0) || (config->top_percent >= 100)) {
+
+                fprintf(stderr, "Top/left percents must be between 0-100.\n");
+                return -1;
+        }
+
+        if (((config->width_mm == 0) &&
+             ((config->width_percent <= 0) || (config->width_percent > 100))) ||
+            (config->left_percent + config->width_percent > 100) ||
+            ((config->height_mm == 0) &&
+             ((config->height_percent <= 0) ||
+              (config->height_percent > 100))) ||
+            (config->top_percent + config->height_percent > 100)) {
+
+                fprintf(stderr,
+                        "Width/height must be between 1-100, and must not "
+                        "add to >100 when offset by left/top.");
+
+                return -1;
+        }
+
+        return 0;
+}
+
+/*
+ * Read left,top,width,height, each a percent of the touchscreen or with
+ * an mm suffix, millimetres.
+ */
+static int read_trackpad_dimensions(trackpad_config *config, char *arg) {
+        char *end;
+        int index;
+        int32_t *mm[4];
+        int *percent[4];
+        double value;
+
+        percent[0] = &(config->left_percent);
+        percent[1] = &(config->top_percent);
+        percent[2] = &(config->width_percent);
+        percent[3] = &(config->height_percent);
+        mm[0] = &(config->left_mm);
+        mm[1] = &(config->top_mm);
+        mm[2] = &(config->width_mm);
+        mm[3] = &(config->height_mm);
+        for (index = 0; index < 4; index += 1) {
+                value = strtod(arg, &end);
+                if (end == arg) {
+                        fprintf(stderr, "Scanned only %d items\n", index);
+                        return -1;
+                }
+
+                *(mm[index]) = 0;
+                if (strncmp(end, "mm", 2) == 0) {
+                        if ((value < 0) || (value > MAX_REGION_MM)) {
+                                fprintf(stderr,
+                                        "Millimetres must be between 0-%d.\n",
+                                        MAX_REGION_MM);
+
+                                return -1;
+                        }
+
+                        *(mm[index]) = lround(value * 65536);
+                        *(percent[index]) = 0;
+                        end += 2;
+
+                } else {
+                        *(percent[index]) = value;
+                        if (*(percent[index]) != value) {
+                                fprintf(stderr, "Percents must be whole\n");
+                                return -1;
+                        }
+
+                        if (*end == '%') {
+                                end += 1;
+                        }
+                }
+
+                if (index == 3) {
+                        arg = end;
+                        break;
+                }
+
+                if (*end != ',') {
+                        fprintf(stderr, "Scanned only %d items\n", index + 1);
+                        return -1;
+                }
+
+                arg = end + 1;
+        }
+
+        while (isspace((unsigned char)*arg)) {
+                arg += 1;
+        }
+
+        if (*arg != '\0') {
+                fprintf(stderr, "Unexpected %s\n", arg);
+                return -1;
+        }
+
+        return check_trackpad_dimensions(config);
+}
+
+/*
+ * Compile a checked config off the hot path and stage it. It is applied
+ * at the end of the frame in progress, or right away between frames. The
+ * axis ranges of the trackpad can't change, so a new rectangle or scale
+ * becomes a new gain onto the same range.
+ */
+static int stage_config(trackscreen_context *ctx, trackpad_config *next) {
+        /*
+         * The trackpad's axes were sized for the orientation it was
+         * created with, so a quarter turn more or less has to wait for a
+         * restart.
+         */
+        if ((ctx->tp_range_x != 0) &&
+            ((next->rotation % 180) != (ctx->config.rotation % 180))) {
+
+                fprintf(stderr, "Turning by 90 degrees needs a restart\n");
+                errno = EINVAL;
+                return -1;
+        }
+
+        /* Past the scale it started with, touches would pin at the edge. */
+        if ((ctx->tp_range_x != 0) && (next->scale > ctx->tp_scale)) {
+                fprintf(stderr,
+                        "A scale above %.3f needs a restart\n",
+                        ctx->tp_scale / 65536.0);
+
+                errno = EINVAL;
+                return -1;
+        }
+
+        if ((next->frame_interval != 0) &&
+            (ctx->frame_source.fd < 0) &&
+            (setup_frame_timer(ctx) != 0)) {
+
+                return -1;
+        }
+
+        if (compile_config(ctx, next) != 0) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        ctx->staged = *next;
+        ctx->config_staged = 1;
+        apply_config(ctx);
+        return 0;
+}
+
+/* Build and check a new config for a control request. */
+static int control_command(trackscreen_context *ctx,
+                           control_message *message) {
+
+        int index;
+        trackpad_config next;
+        int32_t *values;
+
+        values = message->values;
+        next = ctx->config;
+        if (ctx->config_staged != 0) {
+                next = ctx->staged;
+        }
+
+        switch (message->command) {
+        case CONTROL_REGION:
+                next.left_percent = values[0];
+                next.top_percent = values[1];
+                next.width_percent = values[2];
+                next.height_percent = values[3];
+                next.left_mm = 0;
+                next.top_mm = 0;
+                next.width_mm = 0;
+                next.height_mm = 0;
+                if (check_trackpad_dimensions(&next) != 0) {
+                        return -EINVAL;
+                }
+
+                break;
+
+        case CONTROL_REGION_MM:
+                next.left_percent = 0;
+                next.top_percent = 0;
+                next.width_percent = 0;
+                next.height_percent = 0;
+                next.left_mm = values[0];
+                next.top_mm = values[1];
+                next.width_mm = values[2];
+                next.height_mm = values[3];
+                if ((values[2] == 0) || (values[3] == 0) ||
+                    (check_trackpad_dimensions(&next) != 0)) {
+
+                        return -EINVAL;
+                }
+
+                break;
+
+        case CONTROL_SCALE:
+                if ((values[0] <= 0) || (values[0] > (256 << 16))) {
+                        return -EINVAL;
+                }
+
+                next.scale = values[0];
+                break;
+
+        case CONTROL_FRAME_INTERVAL:
+                if (values[0] < 0) {
+                        return -EINVAL;
+                }
+
+                next.frame_interval = values[0];
+                break;
+
+        case CONTROL_ORIENTATION:
+                if ((values[0] < 0) || (values[0] > 270) ||
+                    (values[0] % 90 != 0) ||
+                    ((values[1] & ~(FLIP_X | FLIP_Y)) != 0)) {
+
+                        return -EINVAL;
+                }
+
+                next.rotation = values[0];
+                next.flip = values[1];
+                break;
+
+        case CONTROL_KEYCODES:
+                for (index = 0; index < 2; index += 1) {
+                        if ((values[index] <= 0) || (values[index] > KEY_MAX)) {
+                                return -EINVAL;
+                        }
+
+                        next.keycode[index] = values[index];
+                }
+
+                break;
+
+        default:
+                return -EOPNOTSUPP;
+        }
+
+        if (stage_config(ctx, &next) != 0) {
+                return -errno;
+        }
+
+        if (ctx->config_staged != 0) {
+                return CONTROL_PENDING;
+        }
+
+        return 0;
+}
+
+static void control_reply(trackscreen_context *ctx,
+                          control_message *message) {
+
+        const trackpad_config *config;
+
+        config = &(ctx->config);
+        memset(message->values, 0, sizeof(message->values));
+        switch (message->command) {
+        case CONTROL_REGION:
+                message->values[0] = config->left_percent;
+                message->values[1] = config->top_percent;
+                message->values[2] = config->width_percent;
+                message->values[3] = config->height_percent;
+                break;
+
+        case CONTROL_SCALE:
+                message->values[0] = config->scale;
+                break;
+
+        case CONTROL_FRAME_INTERVAL:
+                message->values[0] = config->frame_interval;
+                break;
+
+        case CONTROL_KEYCODES:
+                message->values[0] = config->keycode[0];
+                message->values[1] = config->keycode[1];
+                break;
+
+        case CONTROL_REGION_MM:
+                message->values[0] = config->left_mm;
+                message->values[1] = config->top_mm;
+                message->values[2] = config->width_mm;
+                message->values[3] = config->height_mm;
+                break;
+
+        case CONTROL_ORIENTATION:
+                message->values[0] = config->rotation;
+                message->values[1] = config->flip;
+                break;
+
+        default:
+                break;
+        }
+
+        send(ctx->control_client.fd,
+             message,
+             sizeof(*message),
+             MSG_DONTWAIT | MSG_NOSIGNAL);
+
+        return;
+}
+
+static void control_disconnect(trackscreen_context *ctx) {
+        if (ctx->control_client.fd < 0) {
+                return;
+        }
+
+        epoll_ctl(ctx->epfd, EPOLL_CTL_DEL, ctx->control_client.fd, NULL);
+        close(ctx->control_client.fd);
+        ctx->control_client.fd = -1;
+        return;
+}
+
+static int control_client_ready(trackscreen_context *ctx,
+                                loop_source *source,
+                                uint32_t events) {
+
+        control_message message;
+        ssize_t size;
+
+        size = recv(source->fd, &message, sizeof(message), MSG_DONTWAIT);
+        if (size <= 0) {
+                if ((size == 0) || (errno != EAGAIN)) {
+                        control_disconnect(ctx);
+                }
+
+                return 0;
+        }
+
+        if (size != sizeof(message)) {
+                message.status = -EINVAL;
+
+        } else {
+                message.status = control_command(ctx, &message);
+        }
+
+        if (ctx->verbose) {
+                printf("Control command %u: %s\n",
+                       message.command,
+                       (message.status == CONTROL_PENDING) ?
+                       "Pending" : strerror(-message.status));
+        }
+
+        control_reply(ctx, &message);
+        return 0;
+}
+
+/* One client at a time; a new connection replaces the old one. */
+static int control_ready(trackscreen_context *ctx,
+                         loop_source *source,
+                         uint32_t events) {
+
+        int client;
+
+        client = accept4(source->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client < 0) {
+                return 0;
+        }
+
+        control_disconnect(ctx);
+        if (loop_add(ctx,
+                     &(ctx->control_client),
+                     client,
+                     control_client_ready) != 0) {
+
+                ctx->control_client.fd = -1;
+                close(client);
+        }
+
+        return 0;
+}
+
+static int setup_control(trackscreen_context *ctx) {
+        struct sockaddr_un address;
+        int fd;
+
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (strlen(ctx->control_path) >= sizeof(address.sun_path)) {
+                fprintf(stderr, "Control socket path too long\n");
+                return -1;
+        }
+
+        strcpy(address.sun_path, ctx->control_path);
+        fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+                perror("Cannot create control socket");
+                return -1;
+        }
+
+        if (remove_stale_socket(ctx->control_path) != 0) {
+                close(fd);
+                return -1;
+        }
+
+        if ((bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0) ||
+            (listen(fd, 4) != 0)) {
+
+                fprintf(stderr,
+                        "Cannot listen on %s: %s\n",
+                        ctx->control_path,
+                        strerror(errno));
+
+                close(fd);
+                return -1;
+        }
+
+        if (loop_add(ctx, &(ctx->control_source), fd, control_ready) != 0) {
+                ctx->control_source.fd = -1;
+                close(fd);
+                return -1;
+        }
+
+        return 0;
+}
+
+static int parse_axis(const char *arg) {
+        char *end;
+        int index;
+        long value;
+
+        for (index = 0;
+             index < sizeof(axis_names) / sizeof(axis_names[0]);
+             index += 1) {
+
+                if (strcmp(arg, axis_names[index].name) == 0) {
+                        return axis_names[index].code;
+                }
+        }
+
+        value = strtol(arg, &end, 0);
+        if ((end == arg) || (*end != '\0') || (value < 0) ||
+            (value > ABS_MAX)) {
+
+                return -1;
+        }
+
+        return value;
+}
+
+/*
+ * The width of the kernel's long, which can differ from ours when a 32
+ * bit build runs on a 64 bit kernel. Under linux32, uname reports the
+ * 32 bit machine, but only a 64 bit kernel has that personality.
+ */
+static int kernel_long_bits(void) {
+        struct utsname name;
+
+        if ((personality(0xffffffff) & PER_MASK) == PER_LINUX32) {
+                return 64;
+        }
+
+        if (uname(&name) != 0) {
+                return 8 * sizeof(long);
+        }
+
+        if ((strstr(name.machine, "64") != NULL) ||
+            (strcmp(name.machine, "s390x") == 0)) {
+
+                return 64;
+        }
+
+        return 32;
+}
+
+/*
+ * Parse the -n argument. A plain name is matched exactly, as it always
+ * was; anything with an '=' is a list of key=value terms.
+ */
+static int parse_matcher(device_matcher *matcher, const char *arg) {
+        char *axis;
+        char *axis_save;
+        int code;
+        char *end;
+        char *save;
+        char *term;
+        char *value;
+
+        memset(matcher, 0, sizeof(*matcher));
+        matcher->vendor = -1;
+        matcher->product = -1;
+        matcher->word_bits = kernel_long_bits();
+        matcher->terms = strdup(arg);
+        if (matcher->terms == NULL) {
+                perror("Cannot copy matcher");
+                return -1;
+        }
+
+        if (strchr(arg, '=') == NULL) {
+                matcher->name = matcher->terms;
+                matcher->exact = 1;
+                goto parseEnd;
+        }
+
+        for (term = strtok_r(matcher->terms, ",", &save);
+             term != NULL;
+             term = strtok_r(NULL, ",", &save)) {
+
+                value = strchr(term, '=');
+                if (value == NULL) {
+                        goto parseFail;
+                }
+
+                *value = '\0';
+                value += 1;
+                if (strcmp(term, "name") == 0) {
+                        matcher->name = value;
+
+                } else if (strcmp(term, "phys") == 0) {
+                        matcher->phys = value;
+
+                } else if (strcmp(term, "uniq") == 0) {
+                        matcher->uniq = value;
+
+                } else if (strcmp(term, "id") == 0) {
+                        matcher->vendor = strtol(value, &end, 16);
+                        if ((end == value) || (*end != ':')) {
+                                goto parseFail;
+                        }
+
+                        value = end + 1;
+                        matcher->product = strtol(value, &end, 16);
+                        if ((end == value) || (*end != '\0')) {
+                                goto parseFail;
+                        }
+
+                } else if (strcmp(term, "abs") == 0) {
+                        for (axis = strtok_r(value, "+", &axis_save);
+                             axis != NULL;
+                             axis = strtok_r(NULL, "+", &axis_save)) {
+
+                                code = parse_axis(axis);
+                                if ((code < 0) ||
+                                    (matcher->abs_count == MATCHER_AXES)) {
+
+                                        goto parseFail;
+                                }
+
+                                matcher->abs[matcher->abs_count] = code;
+                                matcher->abs_count += 1;
+                        }
+
+                } else {
+                        goto parseFail;
+                }
+        }
+
+parseEnd:
+        /* Without abs=, insist on a multitouch screen as before. */
+        if (matcher->abs_count == 0) {
+                matcher->abs[0] = ABS_MT_POSITION_Y;
+                matcher->abs_count = 1;
+        }
+
+        return 0;
+
+parseFail:
+        fprintf(stderr,
+                "Invalid device match '%s'. See -h for usage.\n",
+                arg);
+
+        free(matcher->terms);
+        matcher->terms = NULL;
+        return -1;
+}
+
+/*
+ * Test a bit in a capability bitmap, as sysfs and uevents print them: hex
+ * words separated by spaces, most significant first, each word_bits wide.
+ */
+static int sysfs_has_bit(const char *bitmap, int bit, int word_bits) {
+        int count;
+        char *end;
+        int index;
+        uint64_t words[(KEY_MAX / 32) + 1];
+
+        if (bitmap == NULL) {
+                return 0;
+        }
+
+        for (count = 0; count < sizeof(words) / sizeof(words[0]); count += 1) {
+                words[count] = strtoull(bitmap, &end, 16);
+                if (end == bitmap) {
+                        break;
+                }
+
+                bitmap = end;
+        }
+
+        index = count - 1 - (bit / word_bits);
+        if (index < 0) {
+                return 0;
+        }
+
+        return (words[index] >> (bit % word_bits)) & 1;
+}
+
+/* Copy a uevent string property, without the quotes the kernel adds. */
+static void udev_string(struct udev_device *device,
+                        const char *key,
+                        char *buffer,
+                        size_t size) {
+
+        size_t length;
+        const char *value;
+
+        value = udev_device_get_property_value(device, key);
+        if (value == NULL) {
+                value = "";
+        }
+
+        if (value[0] == '"') {
+                value += 1;
+        }
+
+        snprintf(buffer, size, "%s", value);
+        length = strlen(buffer);
+        if ((length > 0) && (buffer[length - 1] == '"')) {
+                buffer[length - 1] = '\0';
+        }
+}
+
+static int glob_matches(const char *pattern, const char *value) {
+        return (pattern == NULL) || (fnmatch(pattern, value, 0) == 0);
+}
+
+/*
+ * Check an input event device against -n. Everything comes from the
+ * properties libudev caches from the parent's uevent, so no device is
+ * opened and each candidate costs one small sysfs read.
+ */
+static int input_device_matches(trackscreen_context *ctx,
+                                struct udev_device *device) {
+
+        const char *abs_bits;
+        unsigned int bus;
+        const char *devnode;
+        int index;
+        device_matcher *matcher;
+        char name[256];
+        struct udev_device *parent;
+        char phys[256];
+        const char *product;
+        unsigned int product_id;
+        const char *reason;
+        char uniq[256];
+        unsigned int vendor_id;
+
+        devnode = udev_device_get_devnode(device);
+        parent = udev_device_get_parent(device);
+        if ((devnode == NULL) || (parent == NULL)) {
+                return 0;
+        }
+
+        matcher = &(ctx->matcher);
+        udev_string(parent, "NAME", name, sizeof(name));
+        udev_string(parent, "PHYS", phys, sizeof(phys));
+        udev_string(parent, "UNIQ", uniq, sizeof(uniq));
+        product = udev_device_get_property_value(parent, "PRODUCT");
+        abs_bits = udev_device_get_property_value(parent, "ABS");
+        reason = NULL;
+        if ((matcher->name != NULL) &&
+            (matcher->exact ? (strcmp(name, matcher->name) != 0) :
+                              !glob_matches(matcher->name, name))) {
+
+                reason = "name";
+
+        } else if ((matcher->vendor >= 0) &&
+                   ((product == NULL) ||
+                    (sscanf(product,
+                            "%x/%x/%x",
+                            &bus,
+                            &vendor_id,
+                            &product_id) != 3) ||
+                    (vendor_id != matcher->vendor) ||
+                    (product_id != matcher->product))) {
+
+                reason = "id";
+
+        } else if (!glob_matches(matcher->phys, phys)) {
+                reason = "phys";
+
+        } else if (!glob_matches(matcher->uniq, uniq)) {
+                reason = "uniq";
+
+        } else if (!sysfs_has_bit(udev_device_get_property_value(parent,
+                                                                 "EV"),
+                                  EV_ABS,
+                                  matcher->word_bits)) {
+
+                reason = "EV_ABS";
+
+        } else {
+                for (index = 0; index < matcher->abs_count; index += 1) {
+                        if (!sysfs_has_bit(abs_bits,
+                                           matcher->abs[index],
+                                           matcher->word_bits)) {
+
+                                reason = "abs";
+                                break;
+                        }
+                }
+        }
+
+        if (reason != NULL) {
+                if (ctx->verbose) {
+                        fprintf(stderr,
+                                "Skip %s '%s', %s does not match\n",
+                                devnode,
+                                name,
+                                reason);
+                }
+
+                return 0;
+        }
+
+        return 1;
+}
+
+/*
+ * Look the touchscreen up in sysfs through libudev, so only the matching
+ * event node is opened. Opening every node can block, or wake devices
+ * that were asleep.
+ */
+static int find_input_by_name(trackscreen_context *ctx,
+                              const char *arg) {
+
+        struct udev_device *device;
+        const char *devnode;
+        struct udev_enumerate *enumerate;
+        struct udev_list_entry *entry;
+        int fd;
+        uint64_t start;
+        const char *syspath;
+
+        start = monotonic_ns();
+        if (ctx->udev == NULL) {
+                ctx->udev = udev_new();
+                if (ctx->udev == NULL) {
+                        return -1;
+                }
+        }
+
+        enumerate = udev_enumerate_new(ctx->udev);
+        if (enumerate == NULL) {
+                return -1;
+        }
+
+        devnode = NULL;
+        fd = -1;
+        udev_enumerate_add_match_subsystem(enumerate, "input");
+        udev_enumerate_add_match_sysname(enumerate, "event*");
+        if (udev_enumerate_scan_devices(enumerate) < 0) {
+                goto findEnd;
+        }
+
+        udev_list_entry_foreach(entry,
+                                udev_enumerate_get_list_entry(enumerate)) {
+
+                syspath = udev_list_entry_get_name(entry);
+                device = udev_device_new_from_syspath(ctx->udev, syspath);
+                if (device == NULL) {
+                        continue;
+                }
+
+                if (input_device_matches(ctx, device) == 0) {
+                        udev_device_unref(device);
+                        continue;
+                }
+
+                devnode = udev_device_get_devnode(device);
+                snprintf(ctx->ts_node, sizeof(ctx->ts_node), "%s", devnode);
+                fd = open(devnode, O_RDONLY | O_CLOEXEC);
+                if (ctx->verbose) {
+                        printf("Found %s matching '%s' in %.3f ms\n",
+                               devnode,
+                               arg,
+                               (monotonic_ns() - start) / 1e6);
+                }
+
+                udev_device_unref(device);
+                break;
+        }
+
+findEnd:
+        if (devnode == NULL) {
+                errno = ENOENT;
+        }
+
+        udev_enumerate_unref(enumerate);
+        return fd;
+}
+
+static int open_touchscreen(trackscreen_context *ctx,
+                            const char *path,
+                            int use_name) {
+
+        if (use_name != 0) {
+                return find_input_by_name(ctx, path);
+        }
+
+        snprintf(ctx->ts_node, sizeof(ctx->ts_node), "%s", path);
+        return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+/* Put the directory part of path in directory, "." if there is none. */
+static void parent_directory(char *directory,
+                             size_t size,
+                             const char *path) {
+
+        char *slash;
+
+        snprintf(directory, size, "%s", path);
+        slash = strrchr(directory, '/');
+        if (slash == NULL) {
+                snprintf(directory, size, ".");
+
+        } else if (slash == directory) {
+                slash[1] = '\0';
+
+        } else {
+                *slash = '\0';
+        }
+
+        return;
+}
+
+/*
+ * Watch the directory the touchscreen will appear in, or while that does
+ * not exist yet, its nearest ancestor that does. Returns the watched path
+ * length, or -1.
+ */
+static int watch_directory(int inotify_fd,
+                           const char *directory,
+                           int *watch) {
+
+        char path[PATH_MAX];
+        char *slash;
+
+        if (*watch >= 0) {
+                inotify_rm_watch(inotify_fd, *watch);
+        }
+
+        snprintf(path, sizeof(path), "%s", directory);
+        while (true) {
+                *watch = inotify_add_watch(inotify_fd, path, WAIT_EVENTS);
+                if ((*watch >= 0) || (errno != ENOENT)) {
+                        break;
+                }
+
+                slash = strrchr(path, '/');
+                if ((slash == NULL) || (slash == path)) {
+                        snprintf(path, sizeof(path), "/");
+
+                } else {
+                        *slash = '\0';
+                }
+        }
+
+        if (*watch < 0) {
+                return -1;
+        }
+
+        return strlen(path);
+}
+
+/*
+ * Whether an open failed only because the touchscreen isn't ready yet:
+ * not there, not yet given its permissions by udev, or still probing.
+ */
+static int touchscreen_pending(int error) {
+        return (error == ENOENT) ||
+               (error == EACCES) ||
+               (error == EPERM) ||
+               (error == ENXIO) ||
+               (error == ENODEV);
+}
+
+/*
+ * Open the touchscreen, and with --wait block until it shows up instead
+ * of failing and getting respawned. Each node created or made accessible
+ * in the watched directory triggers another try. A node that is there
+ * but can't be opened yet is also retried every WAIT_RETRY_MS, since a
+ * driver finishing its probe changes nothing inotify can see.
+ */
+static int wait_for_touchscreen(trackscreen_context *ctx,
+                                const char *path,
+                                int use_name) {
+
+        char buffer[4096]
+                __attribute__((aligned(__alignof__(struct inotify_event))));
+
+        uint64_t deadline;
+        char directory[PATH_MAX];
+        int error;
+        int fd;
+        int inotify_fd;
+        uint64_t now;
+        struct pollfd poll_fd;
+        uint64_t start;
+        int timeout;
+        int watch;
+        int watched;
+
+        fd = open_touchscreen(ctx, path, use_name);
+        if ((fd >= 0) ||
+            (touchscreen_pending(errno) == 0) ||
+            (ctx->wait_timeout == 0)) {
+
+                return fd;
+        }
+
+        start = monotonic_ns();
+        deadline = start + (ctx->wait_timeout * 1000000000ULL);
+        snprintf(directory, sizeof(directory), "/dev/input");
+        if (use_name == 0) {
+                parent_directory(directory, sizeof(directory), path);
+        }
+
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd < 0) {
+                perror("Cannot create inotify descriptor");
+                return -1;
+        }
+
+        if (ctx->verbose) {
+                printf("Waiting for %s\n", path);
+        }
+
+        watch = -1;
+        watched = 0;
+        while (true) {
+                /* Move the watch down as missing directories appear. */
+                if (watched == 0) {
+                        watched = watch_directory(inotify_fd,
+                                                  directory,
+                                                  &watch);
+
+                        if (watched < 0) {
+                                perror("Cannot watch for the touchscreen");
+                                break;
+                        }
+
+                        watched = (watched == strlen(directory));
+                }
+
+                /* Try again after the watch, so nothing slips between. */
+                fd = open_touchscreen(ctx, path, use_name);
+                error = errno;
+                if ((fd >= 0) || (touchscreen_pending(error) == 0)) {
+                        break;
+                }
+
+                timeout = -1;
+                if (ctx->wait_timeout > 0) {
+                        now = monotonic_ns();
+                        if (now >= deadline) {
+                                errno = ETIMEDOUT;
+                                break;
+                        }
+
+                        timeout = ((deadline - now) + 999999) / 1000000;
+                }
+
+                if ((error != ENOENT) &&
+                    ((timeout < 0) || (timeout > WAIT_RETRY_MS))) {
+
+                        timeout = WAIT_RETRY_MS;
+                }
+
+                poll_fd.fd = inotify_fd;
+                poll_fd.events = POLLIN;
+                poll_fd.revents = 0;
+                if ((poll(&poll_fd, 1, timeout) < 0) && (errno != EINTR)) {
+                        perror("Cannot wait for the touchscreen");
+                        break;
+                }
+
+                while (read(inotify_fd, buffer, sizeof(buffer)) > 0) {
+                        continue;
+                }
+        }
+
+        close(inotify_fd);
+        if (fd >= 0) {
+                printf("Touchscreen %s attached after waiting %.3f s\n",
+                       path,
+                       (monotonic_ns() - start) / 1e9);
+        }
+
+        return fd;
+}
+
+/*
+ * Warm start from --cache. The node is only opened if it still has the
+ * cached device number, and then only its identity is checked before the
+ * cached axes are used, skipping discovery and capability probing.
+ */
+static int load_device_cache(trackscreen_context *ctx,
+                             const char *path,
+                             int use_name) {
+
+        device_cache cache;
+        int fd;
+        struct input_id id;
+        struct stat info;
+        char name[sizeof(cache.name)];
+        char phys[sizeof(cache.phys)];
+        const char *reason;
+
+        reason = "unreadable";
+        fd = open(ctx->cache_path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                goto loadEnd;
+        }
+
+        if ((read(fd, &cache, sizeof(cache)) != sizeof(cache)) ||
+            (cache.magic != CACHE_MAGIC) ||
+            (cache.size != sizeof(cache))) {
+
+                goto loadEnd;
+        }
+
+        close(fd);
+        fd = -1;
+        reason = "for another device";
+        cache.match[sizeof(cache.match) - 1] = '\0';
+        cache.node[sizeof(cache.node) - 1] = '\0';
+        if ((cache.use_name != use_name) || (strcmp(cache.match, path) != 0)) {
+                goto loadEnd;
+        }
+
+        reason = "stale";
+        if ((stat(cache.node, &info) != 0) ||
+            (info.st_rdev != cache.rdev) ||
+            (cache.slot_count == 0) ||
+            (cache.slot_count > MAX_SLOTS)) {
+
+                goto loadEnd;
+        }
+
+        fd = open(cache.node, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                goto loadEnd;
+        }
+
+        memset(&id, 0, sizeof(id));
+        memset(name, 0, sizeof(name));
+        memset(phys, 0, sizeof(phys));
+        if ((ioctl(fd, EVIOCGID, &id) != 0) ||
+            (ioctl(fd, EVIOCGNAME(sizeof(name) - 1), name) < 0) ||
+            (ioctl(fd, EVIOCGPHYS(sizeof(phys) - 1), phys) < 0) ||
+            (memcmp(&id, &(cache.id), sizeof(id)) != 0) ||
+            (strncmp(name, cache.name, sizeof(name)) != 0) ||
+            (strncmp(phys, cache.phys, sizeof(phys)) != 0)) {
+
+                goto loadEnd;
+        }
+
+        reason = NULL;
+        device_cache_apply(ctx, &cache);
+        if (ctx->verbose) {
+                printf("Using cached %s for '%s'\n", cache.node, path);
+        }
+
+loadEnd:
+        if (reason != NULL) {
+                if (ctx->verbose) {
+                        printf("Device cache %s is %s\n",
+                               ctx->cache_path,
+                               reason);
+                }
+
+                if (fd >= 0) {
+                        close(fd);
+                }
+
+                return -1;
+        }
+
+        return fd;
+}
+
+/* Record what was just probed, for load_device_cache() next time. */
+static int save_device_cache(trackscreen_context *ctx,
+                             const char *path,
+                             int use_name) {
+
+        device_cache cache;
+        int fd;
+        int status;
+        char temp_path[PATH_MAX];
+
+        if (strlen(path) >= sizeof(cache.match)) {
+                return -1;
+        }
+
+        device_cache_fill(ctx, &cache);
+        cache.use_name = use_name;
+        snprintf(cache.match, sizeof(cache.match), "%s", path);
+
+        /* Write a new file and rename it, so a crash leaves no torn cache. */
+        snprintf(temp_path, sizeof(temp_path), "%s.tmp", ctx->cache_path);
+        fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+                goto saveFail;
+        }
+
+        status = write(fd, &cache, sizeof(cache));
+        if ((close(fd) != 0) || (status != sizeof(cache))) {
+                unlink(temp_path);
+                goto saveFail;
+        }
+
+        if (rename(temp_path, ctx->cache_path) != 0) {
+                unlink(temp_path);
+                goto saveFail;
+        }
+
+        return 0;
+
+saveFail:
+        fprintf(stderr,
+                "Warning: cannot write device cache %s: %s\n",
+                ctx->cache_path,
+                strerror(errno));
+
+        return -1;
+}
+
+/*
+ * Open, grab and probe the touchscreen. Returns 0 or an exit status.
+ *
+ * The cache only pays off when finding the device means walking every
+ * input device in sysfs, about 70 us each. Given a path, the probe it
+ * saves is a dozen ioctls, no more than checking the cache costs.
+ */
+static int open_devices(trackscreen_context *ctx,
+                        const char *path,
+                        int use_name) {
+
+        int cached;
+        int use_cache;
+
+        cached = 0;
+        use_cache = (ctx->cache_path != NULL) && (use_name != 0);
+        if (use_cache != 0) {
+                ctx->ts = load_device_cache(ctx, path, use_name);
+                cached = (ctx->ts >= 0);
+        }
+
+        if (cached == 0) {
+                ctx->ts = wait_for_touchscreen(ctx, path, use_name);
+        }
+
+        if (ctx->ts < 0) {
+                fprintf(stderr,
+                        "Cannot open %s: %s\n",
+                        path,
+                        strerror(errno));
+
+                return 1;
+        }
+
+        grab_touchscreen(ctx, path);
+        if (cached == 0) {
+                if (read_touchscreen_parameters(ctx)) {
+                        return 1;
+                }
+
+                if (use_cache != 0) {
+                        save_device_cache(ctx, path, use_name);
+                }
+        }
+
+        if (allocate_slots(ctx) != 0) {
+                return 1;
+        }
+
+        return 0;
+}
+
+/*
+ * Create the uinput devices to match the touchscreen and the config.
+ * Returns 0 or an exit status.
+ */
+static int create_devices(trackscreen_context *ctx) {
+        int status;
+
+        if (compile_config(ctx, &(ctx->config)) != 0) {
+                return 1;
+        }
+
+        status = setup_trackpad(ctx);
+        if (status != 0) {
+                fprintf(stderr,
+                        "Failed trackpad setup, line %d: %s\n",
+                        status,
+                        strerror(errno));
+
+                return status;
+        }
+
+        if (ctx->config.keycode[0] > 0) {
+                status = setup_keyboard(ctx);
+                if (status != 0) {
+                        fprintf(stderr,
+                                "Failed keyboard setup, line %d: %s\n",
+                                status,
+                                strerror(errno));
+
+                        return status;
+                }
+        }
+
+        return 0;
+}
+
+/*
+ * Take over from the process a hot upgrade replaced. Returns 0, or -1 if
+ * the state can't be used, with whatever was inherited closed again so
+ * the devices can be opened and created afresh.
+ */
+static int inherit_state(trackscreen_context *ctx) {
+        upgrade_header *header;
+        int index;
+        struct iovec iov[7];
+        size_t mask_size;
+        ssize_t size;
+        upgrade_state state;
+        ssize_t total;
+
+        memset(&state, 0, sizeof(state));
+        header = &(state.header);
+        size = read(ctx->inherit_fd, &state, sizeof(state));
+        if ((size < (ssize_t)sizeof(*header)) ||
+            (header->magic != UPGRADE_MAGIC)) {
+
+                fprintf(stderr, "Invalid upgrade state\n");
+                goto inheritFail;
+        }
+
+        if ((header->version != UPGRADE_VERSION) ||
+            (header->state_size != sizeof(state)) ||
+            (header->finger_size != sizeof(finger)) ||
+            (header->emitted_size != sizeof(*ctx->emitted_mt)) ||
+            (header->mask_size != sizeof(uint64_t)) ||
+            (header->event_size != sizeof(struct input_event)) ||
+            (size != sizeof(state))) {
+
+                fprintf(stderr,
+                        "Upgrade state version %u doesn't match %d\n",
+                        header->version,
+                        UPGRADE_VERSION);
+
+                goto inheritClose;
+        }
+
+        if ((state.device.slot_count == 0) ||
+            (state.device.slot_count > MAX_SLOTS) ||
+            (state.slot >= state.device.slot_count) ||
+            (state.tp_scale <= 0) ||
+            (state.input_events < 0) ||
+            (state.input_events > REPORT_DEVICE_EVENTS +
+                                  (state.device.slot_count *
+                                   REPORT_SLOT_EVENTS))) {
+
+                fprintf(stderr, "Invalid upgrade state\n");
+                goto inheritClose;
+        }
+
+        device_cache_apply(ctx, &(state.device));
+        ctx->monotonic_events = state.monotonic_events;
+        if (allocate_slots(ctx) != 0) {
+                goto inheritFree;
+        }
+
+        mask_size = ctx->slot_words * sizeof(uint64_t);
+        iov[0].iov_base = ctx->fingers;
+        iov[0].iov_len = ctx->slot_count * sizeof(finger);
+        iov[1].iov_base = ctx->emitted_mt;
+        iov[1].iov_len = ctx->slot_count * sizeof(*ctx->emitted_mt);
+        iov[2].iov_base = ctx->active_slots;
+        iov[3].iov_base = ctx->dirty_slots;
+        iov[4].iov_base = ctx->left_slots;
+        iov[5].iov_base = ctx->right_slots;
+        iov[6].iov_base = ctx->input_event;
+        iov[6].iov_len = state.input_events * sizeof(struct input_event);
+        total = 0;
+        for (index = 0; index < 7; index += 1) {
+                if ((index >= 2) && (index < 6)) {
+                        iov[index].iov_len = mask_size;
+                }
+
+                total += iov[index].iov_len;
+        }
+
+        if (readv(ctx->inherit_fd, iov, 7) != total) {
+                fprintf(stderr, "Truncated upgrade state\n");
+                goto inheritFree;
+        }
+
+        /* The stages point into the old binary. */
+        ctx->tp_range_x = state.tp_range_x;
+        ctx->tp_range_y = state.tp_range_y;
+        ctx->tp_scale = state.tp_scale;
+        if (compile_config(ctx, &(state.config)) != 0) {
+                ctx->tp_range_x = 0;
+                ctx->tp_range_y = 0;
+                ctx->tp_scale = 0;
+                goto inheritFree;
+        }
+
+        ctx->ts = header->ts;
+        ctx->tp = header->tp;
+        ctx->kbd = header->kbd;
+        set_cloexec(ctx->ts, 1);
+        set_cloexec(ctx->tp, 1);
+        set_cloexec(ctx->kbd, 1);
+        if (ctx->monotonic_events == 0) {
+                select_event_clock(ctx);
+        }
+
+        ctx->slot = state.slot;
+        ctx->finger_count = state.finger_count;
+        ctx->sidekey = state.sidekey;
+        ctx->emitted_slot = state.emitted_slot;
+        memcpy(ctx->emitted_abs, state.emitted_abs, sizeof(ctx->emitted_abs));
+        for (index = 0; index < OUTPUT_COUNT; index += 1) {
+                ctx->outputs[index].slot = state.output_slot[index];
+        }
+
+        ctx->input_events = state.input_events;
+        ctx->config = state.config;
+        close(ctx->inherit_fd);
+        if (ctx->verbose) {
+                printf("Inherited %s with %d fingers down\n",
+                       ctx->ts_node,
+                       ctx->finger_count);
+        }
+
+        return 0;
+
+inheritFree:
+        free_slots(ctx);
+
+inheritClose:
+        /* Ungrab and destroy the old devices, so new ones can replace them. */
+        if (header->ts >= 0) {
+                close(header->ts);
+        }
+
+        close(header->tp);
+        if (header->kbd >= 0) {
+                close(header->kbd);
+        }
+
+        fprintf(stderr, "Starting afresh\n");
+
+inheritFail:
+        close(ctx->inherit_fd);
+        return -1;
+}
+
+enum {
+        OPTION_REALTIME = 0x100,
+        OPTION_CPUS,
+        OPTION_FLIGHT_RECORDER,
+        OPTION_METRICS,
+        OPTION_TRACE,
+        OPTION_PERF,
+        OPTION_ANALYZE,
+        OPTION_FRAME_INTERVAL,
+        OPTION_WAIT,
+        OPTION_CACHE,
+        OPTION_INHERIT,
+        OPTION_CONTROL,
+        OPTION_PROFILES,
+        OPTION_ROTATE,
+        OPTION_FLIP,
+        /* Only set from a config file. */
+        OPTION_DEVICE,
+        OPTION_DEVICE_NAME,
+        OPTION_LEFT_KEY,
+        OPTION_RIGHT_KEY,
+};
+
+static const char short_options[] = "c:d:hk:ns:uv";
+
+static const struct option long_options[] = {
+        {"analyze", optional_argument, NULL, OPTION_ANALYZE},
+        {"cache", required_argument, NULL, OPTION_CACHE},
+        {"control", required_argument, NULL, OPTION_CONTROL},
+        {"cpus", required_argument, NULL, OPTION_CPUS},
+        {"flight-recorder", required_argument, NULL, OPTION_FLIGHT_RECORDER},
+        {"flip", required_argument, NULL, OPTION_FLIP},
+        {"frame-interval", required_argument, NULL, OPTION_FRAME_INTERVAL},
+        {"help", no_argument, NULL, 'h'},
+        {"inherit", required_argument, NULL, OPTION_INHERIT},
+        {"metrics", required_argument, NULL, OPTION_METRICS},
+        {"perf", no_argument, NULL, OPTION_PERF},
+        {"profiles", required_argument, NULL, OPTION_PROFILES},
+        {"realtime", optional_argument, NULL, OPTION_REALTIME},
+        {"rotate", required_argument, NULL, OPTION_ROTATE},
+        {"trace", required_argument, NULL, OPTION_TRACE},
+        {"verbose", no_argument, NULL, 'v'},
+        {"wait", optional_argument, NULL, OPTION_WAIT},
+        {NULL, 0, NULL, 0},
+};
+
+/* What -c files can set. See trackscreen.ini for an example. */
+static const config_setting config_settings[] = {
+        {"device", "path", OPTION_DEVICE, required_argument, 0},
+        {"device", "name", OPTION_DEVICE_NAME, required_argument, 0},
+        {"device", "wait", OPTION_WAIT, optional_argument, 0},
+        {"device", "cache", OPTION_CACHE, required_argument, 0},
+        {"device", "profiles", OPTION_PROFILES, required_argument, 0},
+        {"trackpad", "region", 'd', required_argument, 1},
+        {"trackpad", "scale", 's', required_argument, 1},
+        {"trackpad", "rotate", OPTION_ROTATE, required_argument, 1},
+        {"trackpad", "flip", OPTION_FLIP, required_argument, 1},
+        {"keys", "left", OPTION_LEFT_KEY, required_argument, 1},
+        {"keys", "right", OPTION_RIGHT_KEY, required_argument, 1},
+        {"filters", "frame_interval", OPTION_FRAME_INTERVAL,
+         required_argument, 1},
+        {"realtime", "priority", OPTION_REALTIME, optional_argument, 0},
+        {"realtime", "cpus", OPTION_CPUS, required_argument, 0},
+        {"modes", "io_uring", 'u', no_argument, 0},
+        {"modes", "perf", OPTION_PERF, no_argument, 0},
+        {"modes", "analyze", OPTION_ANALYZE, optional_argument, 0},
+        {"modes", "verbose", 'v', no_argument, 0},
+        {"services", "metrics", OPTION_METRICS, required_argument, 0},
+        {"services", "control", OPTION_CONTROL, required_argument, 0},
+        {"services", "trace", OPTION_TRACE, required_argument, 0},
+        {"services", "flight_recorder", OPTION_FLIGHT_RECORDER,
+         required_argument, 0},
+};
+
+/* Set what one option says. Returns 0, or -1 if arg isn't valid. */
+static int parse_option(trackscreen_context *ctx, int option, char *arg) {
+        char *comma;
+        char *end;
+        int index;
+        double scale;
+
+        switch (option) {
+        case 'd':
+                if (read_trackpad_dimensions(&(ctx->config), arg) != 0) {
+                        fprintf(stderr, "Invalid dimensions\n");
+                        return -1;
+                }
+
+                break;
+
+        case 'k':
+                ctx->config.keycode[0] = atoi(arg);
+                if (ctx->config.keycode[0] <= 0) {
+                        fprintf(stderr, "Invalid keycode\n");
+                        return -1;
+                }
+
+                ctx->config.keycode[1] = ctx->config.keycode[0];
+                /* HACK to avoid Matt having to change his init script. */
+                if (ctx->config.keycode[0] == 85) {
+                        ctx->config.keycode[1] = 93;
+                }
+
+                comma = strchr(arg, ',');
+                if (comma != NULL) {
+                        ctx->config.keycode[1] = atoi(comma + 1);
+                        if (ctx->config.keycode[1] <= 0) {
+                                fprintf(stderr, "Invalid second keycode\n");
+                        }
+                }
+
+                break;
+
+        case 'n':
+                ctx->use_name = 1;
+                break;
+
+        case 's':
+                scale = strtod(arg, &end);
+                if ((end == arg) || (*end != '\0') ||
+                    (scale <= 0) || (scale > 256)) {
+                        fprintf(stderr, "Invalid scale\n");
+                        return -1;
+                }
+
+                ctx->config.scale = lround(scale * 65536);
+
+                break;
+
+        case 'u':
+                ctx->use_uring = 1;
+                break;
+
+        case 'v':
+                ctx->verbose = true;
+                break;
+
+        case OPTION_REALTIME:
+                ctx->rt_priority = DEFAULT_RT_PRIORITY;
+                if (arg != NULL) {
+                        ctx->rt_priority = strtol(arg, &end, 10);
+                        if ((end == arg) || (*end != '\0') ||
+                            (ctx->rt_priority <
+                             sched_get_priority_min(SCHED_FIFO)) ||
+                            (ctx->rt_priority >
+                             sched_get_priority_max(SCHED_FIFO))) {
+
+                                fprintf(stderr, "Invalid realtime priority\n");
+                                return -1;
+                        }
+                }
+
+                break;
+
+        case OPTION_CPUS:
+                if (parse_cpu_list(arg, &(ctx->cpus)) != 0) {
+                        fprintf(stderr, "Invalid CPU list\n");
+                        return -1;
+                }
+
+                ctx->pin_cpus = 1;
+                break;
+
+        case OPTION_FLIGHT_RECORDER:
+                ctx->flight_dir = arg;
+                break;
+
+        case OPTION_METRICS:
+                ctx->metrics_path = arg;
+                break;
+
+        case OPTION_TRACE:
+                ctx->trace_path = arg;
+                break;
+
+        case OPTION_PERF:
+                ctx->use_perf = 1;
+                break;
+
+        case OPTION_ANALYZE:
+                ctx->analyze_period = DEFAULT_ANALYZE_SECONDS;
+                if (arg != NULL) {
+                        ctx->analyze_period = strtol(arg, &end, 10);
+                        if ((end == arg) || (*end != '\0') ||
+                            (ctx->analyze_period <= 0)) {
+
+                                fprintf(stderr, "Invalid analyze period\n");
+                                return -1;
+                        }
+                }
+
+                ctx->analyze_period *= 1000000;
+                break;
+
+        case OPTION_FRAME_INTERVAL:
+                ctx->config.frame_interval = strtol(arg, &end, 10);
+                if ((end == arg) || (*end != '\0') ||
+                    (ctx->config.frame_interval < 0)) {
+
+                        fprintf(stderr, "Invalid frame interval\n");
+                        return -1;
+                }
+
+                break;
+
+        case OPTION_CACHE:
+                ctx->cache_path = arg;
+                break;
+
+        case OPTION_CONTROL:
+                ctx->control_path = arg;
+                break;
+
+        case OPTION_PROFILES:
+                ctx->profile_dir = arg;
+                break;
+
+        case OPTION_ROTATE:
+                ctx->config.rotation = strtol(arg, &end, 10);
+                if ((end == arg) || (*end != '\0') ||
+                    (ctx->config.rotation < 0) ||
+                    (ctx->config.rotation > 270) ||
+                    (ctx->config.rotation % 90 != 0)) {
+
+                        fprintf(stderr, "Rotation must be 0, 90, 180 or 270\n");
+                        return -1;
+                }
+
+                break;
+
+        case OPTION_FLIP:
+                ctx->config.flip = 0;
+                for (end = arg; *end != '\0'; end += 1) {
+                        if (*end == 'x') {
+                                ctx->config.flip |= FLIP_X;
+
+                        } else if (*end == 'y') {
+                                ctx->config.flip |= FLIP_Y;
+
+                        } else {
+                                fprintf(stderr, "Flip must be x, y or xy\n");
+                                return -1;
+                        }
+                }
+
+                break;
+
+        case OPTION_INHERIT:
+                ctx->inherit_fd = strtol(arg, &end, 10);
+                if ((end == arg) || (*end != '\0') || (ctx->inherit_fd < 0)) {
+                        fprintf(stderr, "Invalid inherit descriptor\n");
+                        return -1;
+                }
+
+                break;
+
+        case OPTION_WAIT:
+                ctx->wait_timeout = -1;
+                if (arg != NULL) {
+                        ctx->wait_timeout = strtol(arg, &end, 10);
+                        if ((end == arg) || (*end != '\0') ||
+                            (ctx->wait_timeout <= 0)) {
+
+                                fprintf(stderr, "Invalid wait timeout\n");
+                                return -1;
+                        }
+                }
+
+                break;
+
+        case OPTION_DEVICE:
+        case OPTION_DEVICE_NAME:
+                ctx->device_path = arg;
+                ctx->use_name = (option == OPTION_DEVICE_NAME);
+                break;
+
+        case OPTION_LEFT_KEY:
+        case OPTION_RIGHT_KEY:
+                index = (option == OPTION_RIGHT_KEY);
+                ctx->config.keycode[index] = strtol(arg, &end, 10);
+                if ((end == arg) || (*end != '\0') ||
+                    (ctx->config.keycode[index] <= 0) ||
+                    (ctx->config.keycode[index] > KEY_MAX)) {
+
+                        fprintf(stderr, "Invalid keycode\n");
+                        return -1;
+                }
+
+                break;
+
+        default:
+                return -1;
+        }
+
+        return 0;
+}
+
+static char *strip_spaces(char *text) {
+        char *end;
+
+        while (isspace((unsigned char)*text)) {
+                text += 1;
+        }
+
+        end = text + strlen(text);
+        while ((end > text) && (isspace((unsigned char)end[-1]))) {
+                end -= 1;
+        }
+
+        *end = '\0';
+        return text;
+}
+
+/*
+ * Hand a file setting to its option. Switches take yes or no, and so do
+ * options with an optional argument, as well as a value.
+ */
+static int apply_setting(trackscreen_context *ctx,
+                         const config_setting *setting,
+                         char *value) {
+
+        int enabled;
+
+        if (setting->has_arg == required_argument) {
+                return parse_option(ctx, setting->option, value);
+        }
+
+        enabled = -1;
+        if ((strcmp(value, "yes") == 0) || (strcmp(value, "true") == 0) ||
+            (strcmp(value, "on") == 0)) {
+
+                enabled = 1;
+
+        } else if ((strcmp(value, "no") == 0) ||
+                   (strcmp(value, "false") == 0) ||
+                   (strcmp(value, "off") == 0)) {
+
+                enabled = 0;
+        }
+
+        if (enabled == 0) {
+                return 0;
+        }
+
+        if (enabled == 1) {
+                return parse_option(ctx, setting->option, NULL);
+        }
+
+        if (setting->has_arg == no_argument) {
+                fprintf(stderr, "Expecting yes or no\n");
+                return -1;
+        }
+
+        return parse_option(ctx, setting->option, value);
+}
+
+/*
+ * Read an INI file of [section] lines and key = value settings, where
+ * lines starting with # or ; are comments. Each setting goes through the
+ * option it stands for, so it is checked just like the command line.
+ * The settings point into the file's text, which is kept in *kept. A
+ * profile can only hold the per device settings.
+ */
+static int read_config_file(trackscreen_context *ctx,
+                            const char *path,
+                            char **kept,
+                            int profile) {
+
+        char *end;
+        char *equals;
+        int fd;
+        int index;
+        struct stat info;
+        char *key;
+        char *line;
+        int number;
+        char *next;
+        const char *section;
+        const config_setting *setting;
+        ssize_t size;
+        int status;
+        char *text;
+        char *value;
+
+        status = -1;
+        text = NULL;
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if ((fd < 0) || (fstat(fd, &info) != 0)) {
+                fprintf(stderr, "Cannot read %s: %s\n", path, strerror(errno));
+                goto readConfigEnd;
+        }
+
+        text = malloc(info.st_size + 1);
+        if (text == NULL) {
+                perror("Cannot allocate config");
+                goto readConfigEnd;
+        }
+
+        size = read(fd, text, info.st_size);
+        if (size < 0) {
+                fprintf(stderr, "Cannot read %s: %s\n", path, strerror(errno));
+                goto readConfigEnd;
+        }
+
+        text[size] = '\0';
+        *kept = text;
+        section = "";
+        number = 0;
+        for (line = text; line != NULL; line = next) {
+                number += 1;
+                next = strchr(line, '\n');
+                if (next != NULL) {
+                        *next = '\0';
+                        next += 1;
+                }
+
+                line = strip_spaces(line);
+                if ((*line == '\0') || (*line == '#') || (*line == ';')) {
+                        continue;
+                }
+
+                if (*line == '[') {
+                        end = strchr(line, ']');
+                        if ((end == NULL) || (end[1] != '\0')) {
+                                fprintf(stderr,
+                                        "%s:%d: Bad section\n",
+                                        path,
+                                        number);
+
+                                goto readConfigEnd;
+                        }
+
+                        *end = '\0';
+                        section = strip_spaces(line + 1);
+                        continue;
+                }
+
+                equals = strchr(line, '=');
+                if (equals == NULL) {
+                        fprintf(stderr,
+                                "%s:%d: Expecting key = value\n",
+                                path,
+                                number);
+
+                        goto readConfigEnd;
+                }
+
+                *equals = '\0';
+                key = strip_spaces(line);
+                value = strip_spaces(equals + 1);
+                setting = NULL;
+                for (index = 0;
+                     index < sizeof(config_settings) /
+                             sizeof(config_settings[0]);
+                     index += 1) {
+
+                        if ((strcmp(config_settings[index].section,
+                                    section) == 0) &&
+                            (strcmp(config_settings[index].key, key) == 0)) {
+
+                                setting = &(config_settings[index]);
+                                break;
+                        }
+                }
+
+                if (setting == NULL) {
+                        fprintf(stderr,
+                                "%s:%d: Unknown setting %s in [%s]\n",
+                                path,
+                                number,
+                                key,
+                                section);
+
+                        goto readConfigEnd;
+                }
+
+                if ((profile != 0) && (setting->per_device == 0)) {
+                        fprintf(stderr,
+                                "%s:%d: %s can't be set per device\n",
+                                path,
+                                number,
+                                key);
+
+                        goto readConfigEnd;
+                }
+
+                if (apply_setting(ctx, setting, value) != 0) {
+                        fprintf(stderr,
+                                "%s:%d: Invalid %s\n",
+                                path,
+                                number,
+                                key);
+
+                        goto readConfigEnd;
+                }
+        }
+
+        status = 0;
+
+readConfigEnd:
+        if (fd >= 0) {
+                close(fd);
+        }
+
+        if (*kept != text) {
+                free(text);
+        }
+
+        return status;
+}
+
+/*
+ * Fill in the settings: defaults, then the -c file, then the attached
+ * touchscreen's profile if there is one, then the rest of the command
+ * line on top. Returns 0 or -1.
+ */
+static int load_settings(trackscreen_context *ctx, int argc, char **argv) {
+        const char *file_device;
+        int file_use_name;
+        int option;
+
+        ctx->config.keycode[0] = -1;
+        ctx->config.keycode[1] = -1;
+        ctx->config.scale = 1 << 16;
+        ctx->flight_dir = DEFAULT_FLIGHT_DIR;
+        /* Put trackpad in the bottom center tic-tac-toe square. */
+        ctx->config.left_percent = 33;
+        ctx->config.top_percent = 67;
+        ctx->config.width_percent = 33;
+        ctx->config.height_percent = 33;
+
+        /* Read the file first, wherever -c is, so options override it. */
+        opterr = 0;
+        optind = 0;
+        while (true) {
+                option = getopt_long(argc, argv, short_options,
+                                     long_options, NULL);
+
+                if (option == -1) {
+                        break;
+                }
+
+                if (option != 'c') {
+                        continue;
+                }
+
+                if (ctx->config_path != NULL) {
+                        fprintf(stderr, "Only one config file is allowed\n");
+                        return -1;
+                }
+
+                ctx->config_path = optarg;
+                if (read_config_file(ctx,
+                                     optarg,
+                                     &(ctx->config_text),
+                                     0) != 0) {
+
+                        return -1;
+                }
+        }
+
+        if ((ctx->profile_path[0] != '\0') &&
+            (read_config_file(ctx,
+                              ctx->profile_path,
+                              &(ctx->profile_text),
+                              1) != 0)) {
 
-        dir = opendir("/dev/input");
-        if (dir == NULL) {
-                perror("Cannot open /dev/input");
                 return -1;
         }
 
-        fd = -1;
-        while (1) {
-                entry = readdir(dir);
-                if (entry == NULL) {
+        file_device = ctx->device_path;
+        file_use_name = ctx->use_name;
+        ctx->use_name = 0;
+        opterr = 1;
+        optind = 0;
+        while (true) {
+                option = getopt_long(argc, argv, short_options,
+                                     long_options, NULL);
+
+                if (option == -1) {
                         break;
                 }
 
-                if (strncmp(entry->d_name, "event", 5) != 0) {
-                        if (ctx->verbose) {
-                                printf("Skipping %s\n", entry->d_name);
-                        }
-
+                if (option == 'c') {
                         continue;
                 }
 
-                snprintf(fullpath,
-                         sizeof(fullpath),
-                         "/dev/input/%s",
-                         entry->d_name);
-
-                fullpath[sizeof(fullpath) - 1] = '\0';
-                fd = open(fullpath, O_RDONLY);
-                if (fd < 0) {
-                        if (ctx->verbose) {
-                                fprintf(stderr,
-                                        "Cannot open %s: %s\n",
-                                        fullpath,
-                                        strerror(errno));
+                if (parse_option(ctx, option, optarg) != 0) {
+                        if ((option == 'h') || (option == '?')) {
+                                printf(USAGE, argv[0]);
                         }
 
-                        continue;
+                        return -1;
                 }
+        }
 
-                rc = ioctl(fd, EVIOCGNAME(sizeof(devicename)), devicename);
-                if (rc < 0) {
-                        if (ctx->verbose) {
-                                fprintf(stderr,
-                                        "Could not get name for %s: %s\n",
-                                        fullpath,
-                                        strerror(errno));
-                        }
+        /* A touchscreen on the command line replaces the file's. */
+        if (argc - optind == 1) {
+                ctx->device_path = argv[optind];
 
-                        close(fd);
-                        continue;
+        } else if ((argc == optind) && (file_device != NULL)) {
+                ctx->device_path = file_device;
+                ctx->use_name |= file_use_name;
+
+        } else {
+                fprintf(stderr, "Expecting 1 argument. See -h for usage.\n");
+                return -1;
+        }
+
+        /* A lone left key covers both sides, as it does with -k. */
+        if (ctx->config.keycode[1] <= 0) {
+                ctx->config.keycode[1] = ctx->config.keycode[0];
+        }
+
+        return 0;
+}
+
+/*
+ * Load the settings again, into a scratch context so the running ones
+ * are untouched if the file is bad. Only what trackpad_config holds can
+ * change on the fly, and it is staged just like a control request.
+ * Everything else in the file waits for the next start.
+ */
+static int reload_config(trackscreen_context *ctx) {
+        int argc;
+        trackscreen_context *settings;
+        int status;
+
+        settings = calloc(1, sizeof(*settings));
+        if (settings == NULL) {
+                perror("Cannot reload config");
+                return -1;
+        }
+
+        argc = 0;
+        while (ctx->argv[argc] != NULL) {
+                argc += 1;
+        }
+
+        strcpy(settings->profile_path, ctx->profile_path);
+        status = load_settings(settings, argc, ctx->argv);
+        if (status == 0) {
+                status = stage_config(ctx, &(settings->config));
+        }
+
+        if (status != 0) {
+                fprintf(stderr, "Keeping the current settings\n");
+
+        } else if (ctx->verbose) {
+                printf("Reloaded %s\n",
+                       (ctx->config_path != NULL) ?
+                       ctx->config_path : ctx->profile_path);
+        }
+
+        free(settings->config_text);
+        free(settings->profile_text);
+        free(settings);
+        return status;
+}
+
+/*
+ * Find the attached touchscreen's profile in --profiles, by vendor and
+ * product ID, or else by name. Returns 0 if there is one, or -1.
+ */
+static int find_profile(trackscreen_context *ctx) {
+        char name[sizeof(ctx->ts_name)];
+        char *slash;
+
+        snprintf(ctx->profile_path,
+                 sizeof(ctx->profile_path),
+                 "%s/%04x:%04x.ini",
+                 ctx->profile_dir,
+                 ctx->ts_id.vendor,
+                 ctx->ts_id.product);
+
+        if (access(ctx->profile_path, R_OK) == 0) {
+                return 0;
+        }
+
+        snprintf(name, sizeof(name), "%s", ctx->ts_name);
+        slash = strchr(name, '/');
+        while (slash != NULL) {
+                *slash = '_';
+                slash = strchr(slash, '/');
+        }
+
+        snprintf(ctx->profile_path,
+                 sizeof(ctx->profile_path),
+                 "%s/%s.ini",
+                 ctx->profile_dir,
+                 name);
+
+        if (access(ctx->profile_path, R_OK) == 0) {
+                return 0;
+        }
+
+        ctx->profile_path[0] = '\0';
+        return -1;
+}
+
+/*
+ * Look up the touchscreen's profile once it is attached, before the
+ * virtual devices are made from the config. The settings are loaded
+ * again with the profile in place, so the command line still wins.
+ */
+static int load_profile(trackscreen_context *ctx) {
+        int argc;
+        trackscreen_context *settings;
+        int status;
+
+        if (find_profile(ctx) != 0) {
+                if (ctx->verbose) {
+                        printf("No profile for %04x:%04x %s\n",
+                               ctx->ts_id.vendor,
+                               ctx->ts_id.product,
+                               ctx->ts_name);
                 }
 
-                if (strcmp(devicename, arg) != 0) {
-                        if (ctx->verbose) {
-                                fprintf(stderr,
-                                        "Skip '%s' != '%s'\n",
-                                        devicename,
-                                        arg);
-                        }
+                return 0;
+        }
 
-                        close(fd);
-                        continue;
+        settings = calloc(1, sizeof(*settings));
+        if (settings == NULL) {
+                perror("Cannot load profile");
+                return -1;
+        }
+
+        argc = 0;
+        while (ctx->argv[argc] != NULL) {
+                argc += 1;
+        }
+
+        strcpy(settings->profile_path, ctx->profile_path);
+        status = load_settings(settings, argc, ctx->argv);
+        if (status == 0) {
+                ctx->config = settings->config;
+                if (ctx->verbose) {
+                        printf("Using profile %s\n", ctx->profile_path);
                 }
+        }
 
-                /* See if it has EV_ABS */
-                evbit = 0;
-                ioctl(fd, EVIOCGBIT(0, sizeof(evbit)), &evbit);
-                if ((evbit & (1 << EV_ABS)) == 0) {
-                        if (ctx->verbose) {
-                                fprintf(stderr,
-                                        "Skip %s, missing EV_ABS\n",
-                                        fullpath);
-                        }
+        free(settings->config_text);
+        free(settings->profile_text);
+        free(settings);
+        return status;
+}
 
-                        close(fd);
-                        continue;
+/* Whether an inotify event names the file at path in a watched directory. */
+static int watched_file(const struct inotify_event *event,
+                        int wd,
+                        const char *path) {
+
+        const char *name;
+
+        if ((wd < 0) || (event->wd != wd) || (event->len == 0)) {
+                return 0;
+        }
+
+        name = strrchr(path, '/');
+        if (name == NULL) {
+                name = path;
+
+        } else {
+                name += 1;
+        }
+
+        return strcmp(event->name, name) == 0;
+}
+
+static int config_watch_ready(trackscreen_context *ctx,
+                              loop_source *source,
+                              uint32_t events) {
+
+        char buffer[4096]
+                __attribute__((aligned(__alignof__(struct inotify_event))));
+
+        int changed;
+        const struct inotify_event *event;
+        char *offset;
+        ssize_t size;
+
+        changed = 0;
+        while (true) {
+                size = read(source->fd, buffer, sizeof(buffer));
+                if (size <= 0) {
+                        break;
                 }
 
-                /* See if it has ABS_MT_POSITION_Y */
-                if (!has_abs_bit(fd, ABS_MT_POSITION_Y)) {
-                        if (ctx->verbose) {
-                                fprintf(stderr,
-                                        "Skip %s, missing ABS_MT_POSITION_Y\n",
-                                        fullpath);
+                for (offset = buffer;
+                     offset < buffer + size;
+                     offset += sizeof(*event) + event->len) {
+
+                        event = (const struct inotify_event *)offset;
+                        if (watched_file(event,
+                                         ctx->config_wd,
+                                         ctx->config_path) ||
+                            watched_file(event,
+                                         ctx->profile_wd,
+                                         ctx->profile_path)) {
+
+                                changed = 1;
                         }
+                }
+        }
+
+        if (changed != 0) {
+                reload_config(ctx);
+        }
+
+        return 0;
+}
+
+static int reload_signal_ready(trackscreen_context *ctx,
+                               loop_source *source,
+                               uint32_t events) {
+
+        struct signalfd_siginfo info;
+
+        if (read(source->fd, &info, sizeof(info)) != sizeof(info)) {
+                return 0;
+        }
+
+        reload_config(ctx);
+        return 0;
+}
+
+static int watch_parent(int fd, const char *path) {
+        char directory[PATH_MAX];
+        int wd;
+
+        parent_directory(directory, sizeof(directory), path);
+        wd = inotify_add_watch(fd, directory, CONFIG_EVENTS);
+        if (wd < 0) {
+                fprintf(stderr,
+                        "Cannot watch %s: %s\n",
+                        directory,
+                        strerror(errno));
+        }
+
+        return wd;
+}
+
+/*
+ * Reload on SIGHUP, and when the config file or the touchscreen's profile
+ * is written. Editors often save by renaming a new copy over the old one,
+ * so their directories are watched.
+ */
+static int setup_config_watch(trackscreen_context *ctx) {
+        int fd;
+        sigset_t mask;
+
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGHUP);
+        sigprocmask(SIG_BLOCK, &mask, NULL);
+        fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (fd < 0) {
+                perror("Cannot create signalfd");
+                return -1;
+        }
+
+        if (loop_add(ctx,
+                     &(ctx->reload_signal),
+                     fd,
+                     reload_signal_ready) != 0) {
+
+                ctx->reload_signal.fd = -1;
+                close(fd);
+                return -1;
+        }
+
+        fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd < 0) {
+                perror("Cannot create inotify descriptor");
+                return -1;
+        }
 
+        ctx->config_wd = -1;
+        ctx->profile_wd = -1;
+        if (ctx->config_path != NULL) {
+                ctx->config_wd = watch_parent(fd, ctx->config_path);
+                if (ctx->config_wd < 0) {
                         close(fd);
-                        continue;
+                        return -1;
                 }
+        }
 
-                if (ctx->verbose) {
-                        printf("Found %s matching '%s'\n", fullpath, arg);
+        if (ctx->profile_path[0] != '\0') {
+                ctx->profile_wd = watch_parent(fd, ctx->profile_path);
+                if (ctx->profile_wd < 0) {
+                        close(fd);
+                        return -1;
                 }
-
-                goto end;
         }
 
-        errno = ENOENT;
-        fd = -1;
+        if (loop_add(ctx, &(ctx->config_watch), fd, config_watch_ready) != 0) {
+                ctx->config_watch.fd = -1;
+                close(fd);
+                return -1;
+        }
 
-end:
-        closedir(dir);
-        return fd;
+        return 0;
 }
 
 int main(int argc, char **argv) {
-        int argument_count;
-        char *comma;
+        int index;
         trackscreen_context ctx;
-        char *device_path = NULL;
-        char *end;
-        int finger;
-        int option;
+        uint64_t start;
         int status;
-        int use_name;
 
-        use_name = 0;
+        start = monotonic_ns();
         memset(&ctx, 0, sizeof(ctx));
         ctx.ts = -1;
         ctx.tp = -1;
         ctx.kbd = -1;
-        ctx.keycode[0] = -1;
-        ctx.keycode[1] = -1;
-        ctx.scale = 1.0;
-        /* Put trackpad in the bottom center tic-tac-toe square. */
-        ctx.tp_left_percent = 33;
-        ctx.tp_top_percent = 67;
-        ctx.tp_width_percent = 33;
-        ctx.tp_height_percent = 33;
-        for (finger = 0; finger < MAX_FINGERS; finger += 1) {
-                ctx.fingers[finger].tracking_id = -1;
+        ctx.epfd = -1;
+        ctx.sigfd = -1;
+        ctx.retry_source.fd = -1;
+        ctx.frame_source.fd = -1;
+        ctx.metrics_source.fd = -1;
+        ctx.control_source.fd = -1;
+        ctx.control_client.fd = -1;
+        ctx.config_watch.fd = -1;
+        ctx.reload_signal.fd = -1;
+        ctx.inherit_fd = -1;
+        ctx.argv = argv;
+        for (index = 0; index < PERF_COUNTERS; index += 1) {
+                ctx.perf_fd[index] = -1;
         }
 
-        while (true) {
-                option = getopt(argc, argv, "d:hk:ns:v");
-                if (option == -1) {
-                        break;
-                }
+        ctx.perf_group = -1;
+        if (load_settings(&ctx, argc, argv) != 0) {
+                return 1;
+        }
 
-                switch (option) {
-                case 'd':
-                        status = read_trackpad_dimensions(&ctx, optarg);
-                        if (status != 0) {
-                                fprintf(stderr, "Invalid dimensions\n");
-                                return 1;
-                        }
+        if ((ctx.use_name != 0) &&
+            (parse_matcher(&(ctx.matcher), ctx.device_path) != 0)) {
 
-                        break;
+                return 1;
+        }
 
-                case 'k':
-                        ctx.keycode[0] = atoi(optarg);
-                        if (ctx.keycode[0] <= 0) {
-                                fprintf(stderr, "Invalid keycode\n");
-                                return 1;
-                        }
+        if ((event_ring_init(&(ctx.flight_in), FLIGHT_RECORDER_EVENTS) != 0) ||
+            (event_ring_init(&(ctx.flight_tp), FLIGHT_RECORDER_EVENTS) != 0) ||
+            (event_ring_init(&(ctx.flight_kbd),
+                             FLIGHT_RECORDER_KEY_EVENTS) != 0)) {
 
-                        ctx.keycode[1] = ctx.keycode[0];
-                        /* HACK to avoid Matt having to change his init script. */
-                        if (ctx.keycode[0] == 85) {
-                                ctx.keycode[1] = 93;
-                        }
+                fprintf(stderr, "Cannot allocate flight recorder\n");
+                return 1;
+        }
 
-                        comma = strchr(optarg, ',');
-                        if (comma != NULL) {
-                                ctx.keycode[1] = atoi(comma + 1);
-                                if (ctx.keycode[1] <= 0) {
-                                        fprintf(stderr,
-                                                "Invalid second keycode\n");
-                                }
-                        }
+        if (ctx.trace_path != NULL) {
+                ctx.trace_frames = calloc(TRACE_FRAMES, sizeof(frame_trace));
+                if (ctx.trace_frames == NULL) {
+                        fprintf(stderr, "Cannot allocate frame trace\n");
+                        return 1;
+                }
+        }
 
-                        break;
+        if (ctx.verbose) {
+                ctx.log_ring = calloc(LOG_RING_SIZE, sizeof(log_record));
+                if (ctx.log_ring == NULL) {
+                        fprintf(stderr, "Cannot allocate log ring\n");
+                        return 1;
+                }
+        }
 
-                case 'n':
-                        use_name = 1;
-                        break;
+        status = -1;
+        if (ctx.inherit_fd >= 0) {
+                status = inherit_state(&ctx);
+        }
 
-                case 's':
-                        ctx.scale = strtod(optarg, &end);
-                        if ((end == optarg) || (*end != '\0')) {
-                                fprintf(stderr, "Invalid scale\n");
-                                return 1;
-                        }
+        if (status == 0) {
+                /* Only needed for reloads; the config came along. */
+                if (ctx.profile_dir != NULL) {
+                        find_profile(&ctx);
+                }
 
-                        break;
+        } else {
+                status = open_devices(&ctx, ctx.device_path, ctx.use_name);
+                if (status != 0) {
+                        goto mainEnd;
+                }
 
-                case 'v':
-                        ctx.verbose = true;
-                        break;
+                if ((ctx.profile_dir != NULL) && (load_profile(&ctx) != 0)) {
+                        status = 1;
+                        goto mainEnd;
+                }
 
-                case 'h':
-                default:
-                        printf(USAGE, argv[0]);
-                        return 1;
+                status = create_devices(&ctx);
+                if (status != 0) {
+                        goto mainEnd;
                 }
         }
 
-        argument_count = argc - optind;
-        if (argument_count != 1) {
-                fprintf(stderr, "Expecting 1 argument. See -h for usage.\n");
-                return 1;
+        flight_capture_device(&ctx);
+        ctx.outputs[OUTPUT_TRACKPAD].fd = ctx.tp;
+        ctx.outputs[OUTPUT_TRACKPAD].flight = &(ctx.flight_tp);
+        ctx.outputs[OUTPUT_KEYBOARD].fd = ctx.kbd;
+        ctx.outputs[OUTPUT_KEYBOARD].flight = &(ctx.flight_kbd);
+        for (index = 0; index < OUTPUT_COUNT; index += 1) {
+                ctx.outputs[index].id = index;
         }
 
-        device_path = argv[optind];
-        if (use_name != 0) {
-                ctx.ts = find_input_by_name(&ctx, device_path);
-
-        } else {
-                ctx.ts = open(device_path, O_RDONLY);
+        if (setup_event_loop(&ctx) != 0) {
+                status = 1;
+                goto mainEnd;
         }
 
-        if (ctx.ts < 0) {
+        if (setup_hotplug(&ctx) != 0) {
                 fprintf(stderr,
-                        "Cannot open %s: %s\n",
-                        device_path,
-                        strerror(errno));
+                        "Warning: no udev monitor, the touchscreen "
+                        "can't be reattached if it goes away.\n");
+        }
 
+        if ((ctx.metrics_path != NULL) && (setup_metrics(&ctx) != 0)) {
                 status = 1;
                 goto mainEnd;
         }
 
-        if (ioctl(ctx.ts, EVIOCGRAB, 1) != 0) {
-                fprintf(stderr,
-                        "Warning: failed to grab %s exclusively.\n",
-                        device_path);
+        if ((ctx.control_path != NULL) && (setup_control(&ctx) != 0)) {
+                status = 1;
+                goto mainEnd;
+        }
+
+        if (((ctx.config_path != NULL) || (ctx.profile_dir != NULL)) &&
+            (setup_config_watch(&ctx) != 0)) {
+
+                status = 1;
+                goto mainEnd;
         }
 
-        if (read_touchscreen_parameters(&ctx)) {
+        if (enter_realtime(&ctx) != 0) {
                 status = 1;
                 goto mainEnd;
         }
 
-        compute_trackpad_bounds(&ctx);
-        status = setup_trackpad(&ctx);
+        if (ctx.use_perf != 0) {
+                open_perf_counters(&ctx);
+        }
+
+        if (ctx.verbose) {
+                printf("Started in %.3f ms\n",
+                       (monotonic_ns() - start) / 1e6);
+        }
+
+        getrusage(RUSAGE_SELF, &(ctx.rusage_start));
+        status = run_event_loop(&ctx);
         if (status != 0) {
                 fprintf(stderr,
-                        "Failed trackpad setup, line %d: %s\n",
-                        status,
+                        "Event loop exited: %s\n",
                         strerror(errno));
 
-                goto mainEnd;
+                flight_dump(&ctx, "exit");
+                status = 1;
         }
 
-        if (ctx.keycode > 0) {
-                status = setup_keyboard(&ctx);
-                if (status != 0) {
-                        fprintf(stderr,
-                                "Failed keyboard setup, line %d: %s\n",
-                                status,
-                                strerror(errno));
+        if (ctx.trace_frames != NULL) {
+                write_frame_trace(&ctx);
+        }
 
-                        goto mainEnd;
-                }
+        if (ctx.analyze_period != 0) {
+                analyze_print(&ctx);
         }
 
-        while (true) {
-                status = handle_event(&ctx);
-                if (status != 0) {
-                        goto mainEnd;
+        if (ctx.verbose) {
+                while (log_pending(&ctx)) {
+                        drain_log(&ctx);
                 }
-        }
 
-        status = 0;
+                print_stats(&ctx);
+
+        } else if (ctx.use_perf != 0) {
+                print_perf_counters(&ctx);
+        }
 
 mainEnd:
         if (ctx.ts >= 0) {
@@ -882,5 +7632,62 @@ mainEnd:
                 close(ctx.kbd);
         }
 
+        if (ctx.sigfd >= 0) {
+                close(ctx.sigfd);
+        }
+
+        if (ctx.retry_source.fd >= 0) {
+                close(ctx.retry_source.fd);
+        }
+
+        if (ctx.frame_source.fd >= 0) {
+                close(ctx.frame_source.fd);
+        }
+
+        if (ctx.metrics_source.fd >= 0) {
+                close(ctx.metrics_source.fd);
+                unlink(ctx.metrics_path);
+        }
+
+        if (ctx.control_client.fd >= 0) {
+                close(ctx.control_client.fd);
+        }
+
+        if (ctx.control_source.fd >= 0) {
+                close(ctx.control_source.fd);
+                unlink(ctx.control_path);
+        }
+
+        if (ctx.config_watch.fd >= 0) {
+                close(ctx.config_watch.fd);
+        }
+
+        if (ctx.reload_signal.fd >= 0) {
+                close(ctx.reload_signal.fd);
+        }
+
+        if (ctx.epfd >= 0) {
+                close(ctx.epfd);
+        }
+
+        if (ctx.udev_monitor != NULL) {
+                udev_monitor_unref(ctx.udev_monitor);
+        }
+
+        if (ctx.udev != NULL) {
+                udev_unref(ctx.udev);
+        }
+
+        free(ctx.log_ring);
+        free(ctx.flight_in.events);
+        free(ctx.flight_tp.events);
+        free(ctx.flight_kbd.events);
+        free(ctx.flight_device);
+        close_perf_counters(&ctx);
+        free(ctx.trace_frames);
+        free_slots(&ctx);
+        free(ctx.matcher.terms);
+        free(ctx.config_text);
+        free(ctx.profile_text);
         return status;
 }